@@ -8,6 +8,28 @@
 #include <memory>       //to use unique_ptr in index buffer
 #include <sstream>
 #include <algorithm>    //to use find()
+#include <fcntl.h>      //to use open()
+#include <unistd.h>     //to use pread(), pwrite(), close()
+#include <cerrno>
+#include <cstring>      //to use strerror()
+#include <functional>   //to use function in replacement policies
+#include <queue>        //to use priority_queue in bulk loading
+#include <cstdio>       //to use remove() on temporary files
+#include <map>          //to keep logged page images in order
+#include <new>          //to count heap allocations
+#include <cstdlib>      //to use malloc() in operator new
+#include <limits>       //to use numeric_limits in key traits
+#include <type_traits>  //to use is_same on the key order
+#include <atomic>       //to count pins and disk operations of concurrent operations
+#include <mutex>
+#include <shared_mutex> //to use reader/writer latches of index pages
+#include <thread>
+#include <chrono>       //to time the threads benchmark
+#include <condition_variable>     //to hand page reads to the I/O threads
+#include <sys/uio.h>    //to use pwritev() when flushing adjacent pages
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>  //to compare many keys at once in index pages
+#endif
 
 using namespace std;
 
@@ -16,13 +38,36 @@ using namespace std;
 
 #define     NUMBER_OF_RECORDS       30
 
-#define     D_VALUE     2       //d - degree of the B-tree
-#define     MIN_KEYS    (D_VALUE)
-#define     MAX_KEYS    (2 * D_VALUE)
+#define     D_VALUE     2       //d - degree of newly created B-trees
+#define     INDEX_PAGE_BYTES    0       //if not 0, new B-trees get the highest degree whose index page fits in that many bytes (e.g. 4096)
+#define     DATA_PAGE_RECORDS   0       //how many records can be put in single data page, 0 - as many as keys in index page
+#define     FILE_HEADER_SIZE    4096    //bytes at the beginning of index.dat and data.dat reserved for the file header
+#define     BPLUS_TREE          false   //if records should be kept only in leaves, linked with their siblings (upper pages hold only separators)
+#define     COMPRESSED_PAGES    false   //B+-tree only: if index pages should be saved compressed (keys as bit-packed differences from the first one,
+                                        //record pointers and children as varints), so that as many keys as fit in the bytes go into a page
+#define     CLUSTERED           false   //B+-tree only: if records should be kept in the leaves instead of data.dat (which only feeds create_b_tree then)
+#define     KEY_TYPE            unsigned int    //unsigned int, unsigned long long or string (variable length, B+-tree only - set by itself)
+#define     KEY_COMPARE         less<Key>       //order of the keys (COMPRESSED_PAGES and SIMD_KEY_SEARCH need the natural one)
+#define     MAX_KEY_BYTES       32              //string keys: how long a key can be (up to 255), index pages up to 64 KiB
 
-#define     DATA_PAGE_SIZE      (MAX_KEYS)      //how many records can be put in single data page
 #define     INDEX_BUFFER_LIMIT      10           //how many pages can be put in buffer in RAM
-#define     DATA_BUFFER_LIMIT      2
+#define     INDEX_BUFFER_SHARDS     8           //how many parts (by page id, each with its own latch) the index buffer is split into for concurrent
+                                                //operations - every part gets INDEX_BUFFER_LIMIT / INDEX_BUFFER_SHARDS pages to evict from
+#define     SHARD_MIN_PAGES     8               //fewer parts are made if they'd get fewer pages than that - a single operation can pin
+                                                //its whole path and a few more pages, all of them in the same part
+#define     DATA_BUFFER_LIMIT      2           //how many data pages can be put in buffer in RAM
+#define     INDEX_BUFFER_POLICY     POLICY_LRU      //POLICY_LRU, POLICY_CLOCK or POLICY_LRU_K
+#define     DATA_BUFFER_POLICY      POLICY_LRU
+#define     LRU_K_VALUE         2           //k used by POLICY_LRU_K
+#define     SCAN_PREFETCH_PAGES     4           //how many data pages a range scan loads ahead when it enters a leaf
+#define     INSERT_BATCH_SIZE       100000      //how many consecutive inserts from the instructions file can be applied together
+#define     READ_BATCH_SIZE     64          //how many consecutive reads from the instructions file get the pages they need read ahead together (1 - none)
+#define     IO_THREADS          4           //how many threads read pages read ahead (scans, batches of reads) at once, 0 - the caller reads them one by one
+#define     SIMD_KEY_SEARCH     true        //if keys in index pages should be compared several at a time (SSE2, AVX2 if the CPU has it)
+#define     SEARCH_WINDOW       16          //how many keys are left for comparing at once when searching an index page
+#define     CACHE_LINE_BYTES    64          //arrays in index pages are aligned to and padded to whole cache lines
+#define     OPTIMISTIC_READ_RETRIES     4       //how many times read_record tries to read the index without latching pages (checking their versions)
+                                                //before it latches them, 0 - always latches (string keys always do)
 
 #define     INSTRUCTIONS_TXT_FILENAME   "./tests/manual_instructions.txt"
 
@@ -30,23 +75,260 @@ using namespace std;
 #define     RANDOM_TXT_FILENAME     "./tests/random_data.txt"
 
 #define     DATA_DAT_FILENAME     "data.dat"
+#define     FREE_SPACE_MAP_FILENAME     "data.fsm"      //which data pages have free slots, saved with the headers
 #define     INDEX_DAT_FILENAME      "index.dat"     //same for both manual and random
 
+#define     OPEN_EXISTING_TREE  false           //if the tree saved in index.dat and data.dat should be opened instead of generating new records and rebuilding it
+#define     BULK_LOAD           true            //if the B-tree should be built bottom-up from sorted data.dat instead of inserting records one by one
+#define     BULK_LOAD_FILL_FACTOR       1.0         //how full the pages built by bulk loading are (0.5 - 1.0)
+#define     BULK_LOAD_MEMORY_LIMIT      1000000     //how many index records can be sorted in RAM, more are sorted using temporary files
+#define     BULK_LOAD_TMP_FILENAME      "bulk_load.tmp"     //prefix of temporary files used by bulk loading
+#define     COMPACTION_FILL_FACTOR      0.5         //data.dat is compacted after a remove leaves its pages on average less full than that (0 - only by compact())
+#define     DEFRAGMENT_FREE_RATIO       0.25        //index.dat is defragmented after a remove leaves that part of its pages free (0 - only by defragment())
+
+#define     WAL_ENABLED         false           //if operations should be logged, so that a crash doesn't leave the files half-updated
+#define     WAL_FILENAME        "wal.log"
+#define     WAL_GROUP_COMMIT    8               //how many operations share a single log write and sync
+#define     WAL_CHECKPOINT_BYTES    (16 << 20)  //log size after which the files are synced and the log is emptied
+#define     CLEANER_DIRTY_RATIO     0.25        //pages of a buffer are saved in the background once more than that part of them is dirty
+                                                //(0 - only by evictions and flushes, with WAL_ENABLED operations save them anyway)
+#define     CLEANER_INTERVAL_MS     50          //how often the background page cleaner looks at the buffers
+#define     CLEANER_CHECKPOINT_MS   1000        //how often it saves all the dirty pages and syncs the files, with WAL_ENABLED how often
+                                                //the log is checkpointed
+
 #define     PRINT_FILES         true            //if data.dat and B-tree should be printed
 #define     RANDOM_RECORDS      true
 
+#define     ALLOCATION_BENCHMARK    0       //if not 0, main only inserts that many records (one by one and in batches) into new trees and counts heap allocations
+#define     THREADS_BENCHMARK       0       //if not 0, main only runs reads and inserts from that many threads at once on a tree of NUMBER_OF_RECORDS records
+                                            //and compares them with a single thread (PRINT_FILES should be false)
+
 
 //COUNTERS
 
 
-unsigned int read_count_data = 0;
-unsigned int write_count_data = 0;
-unsigned int read_count_index = 0;
-unsigned int write_count_index = 0;
+atomic<unsigned int> read_count_data(0);        //counted by concurrent operations too
+atomic<unsigned int> write_count_data(0);
+atomic<unsigned int> read_count_index(0);
+atomic<unsigned int> write_count_index(0);
 unsigned int next_data_page_id = 0;
+unsigned int data_records = 0;      //live records in data.dat, decides when it's compacted
 unsigned int next_page_id = 0;      //for index pages
 unsigned int free_list_head = UINT_MAX;     //to hold list of free index pages (in case they were deleted)
-vector<unsigned int> data_pages_with_free_slots;
+unsigned int free_index_pages = 0;      //pages in the free list, decides when index.dat is defragmented
+atomic<unsigned long long> allocation_count(0);        //heap allocations made by the program, counted with ALLOCATION_BENCHMARK only
+
+#if ALLOCATION_BENCHMARK != 0
+//every allocation made with new goes through here, so that they can be counted
+//none of these are inlined - the compiler would see malloc() and free() paired with new and delete
+__attribute__((noinline)) void* operator new(size_t size)
+{
+    allocation_count++;
+    void* memory = malloc(size == 0 ? 1 : size);
+    if (!memory)
+    {
+        throw bad_alloc();
+    }
+    return memory;
+}
+
+__attribute__((noinline)) void operator delete(void* memory) noexcept
+{
+    free(memory);
+}
+
+__attribute__((noinline)) void operator delete(void* memory, size_t) noexcept
+{
+    free(memory);
+}
+
+//used by stable_sort for its temporary buffer
+__attribute__((noinline)) void* operator new(size_t size, const nothrow_t&) noexcept
+{
+    allocation_count++;
+    return malloc(size == 0 ? 1 : size);
+}
+
+__attribute__((noinline)) void operator delete(void* memory, const nothrow_t&) noexcept
+{
+    free(memory);
+}
+
+//arrays of index pages are aligned to cache lines
+__attribute__((noinline)) void* operator new(size_t size, align_val_t alignment)
+{
+    allocation_count++;
+    size_t bytes = static_cast<size_t>(alignment);
+    size_t rounded = size == 0 ? bytes : (size + bytes - 1) / bytes * bytes;       //size has to be a multiple of the alignment
+    void* memory = aligned_alloc(bytes, rounded);
+    if (!memory)
+    {
+        throw bad_alloc();
+    }
+    return memory;
+}
+
+__attribute__((noinline)) void operator delete(void* memory, align_val_t) noexcept
+{
+    free(memory);
+}
+
+__attribute__((noinline)) void operator delete(void* memory, size_t, align_val_t) noexcept
+{
+    free(memory);
+}
+#endif
+
+
+//KEYS
+
+
+typedef KEY_TYPE Key;
+typedef KEY_COMPARE Key_compare;
+
+//what index pages, data pages and bulk loading need to know about the type of the keys:
+//fixed-width integers are kept in arrays of index pages, variable-length keys in slotted pages
+template <typename K>
+struct Key_traits;
+
+template <typename Int, unsigned int type_id>
+struct Integer_key_traits
+{
+    static const unsigned int id = type_id;     //saved in the file headers
+    static const bool fixed_size = true;
+    static const bool compressible = sizeof(Int) == sizeof(unsigned int);     //COMPRESSED_PAGES keep 32-bit differences
+
+    static Int none()       //unused slots of index pages
+    {
+        return numeric_limits<Int>::max();
+    }
+    static Int from_number(unsigned long long number)
+    {
+        return (Int)number;
+    }
+    static unsigned int bytes(Int)
+    {
+        return sizeof(Int);
+    }
+    static unsigned int max_bytes()
+    {
+        return sizeof(Int);
+    }
+    static void put(char*& pos, Int key)
+    {
+        memcpy(pos, &key, sizeof(Int));
+        pos += sizeof(Int);
+    }
+    static Int get(const char*& pos, unsigned int)
+    {
+        Int key;
+        memcpy(&key, pos, sizeof(Int));
+        pos += sizeof(Int);
+        return key;
+    }
+    //compressed pages keep keys as differences from the first one
+    static unsigned int difference(Int first, Int key)
+    {
+        return (unsigned int)(key - first);
+    }
+    static Int add(Int first, unsigned int difference)
+    {
+        return first + difference;
+    }
+};
+
+template <>
+struct Key_traits<unsigned int> : Integer_key_traits<unsigned int, 1> {};
+
+template <>
+struct Key_traits<unsigned long long> : Integer_key_traits<unsigned long long, 2> {};
+
+//up to MAX_KEY_BYTES bytes - only in B+-trees, B-tree separators replaced in place could make a page too big
+template <>
+struct Key_traits<string>
+{
+    static const unsigned int id = 3;
+    static const bool fixed_size = false;
+    static const bool compressible = false;
+
+    static string none()
+    {
+        return string();
+    }
+    static string from_number(unsigned long long number)
+    {
+        return to_string(number);
+    }
+    static unsigned int bytes(const string& key)
+    {
+        return key.size();
+    }
+    static unsigned int max_bytes()
+    {
+        return MAX_KEY_BYTES;
+    }
+    static void put(char*& pos, const string& key)
+    {
+        memcpy(pos, key.data(), key.size());
+        pos += key.size();
+    }
+    static string get(const char*& pos, unsigned int size)
+    {
+        string key(pos, size);
+        pos += size;
+        return key;
+    }
+    static unsigned int difference(const string&, const string&)
+    {
+        return 0;
+    }
+    static string add(const string& first, unsigned int)
+    {
+        return first;
+    }
+};
+
+const Key no_key = Key_traits<Key>::none();     //unused slots of index pages, key of records that weren't found
+
+bool key_less(const Key& a, const Key& b)
+{
+    return Key_compare()(a, b);
+}
+
+bool key_equal(const Key& a, const Key& b)
+{
+    return !key_less(a, b) && !key_less(b, a);
+}
+
+//longer keys don't fit in data pages
+bool key_fits(const Key& key)
+{
+    return Key_traits<Key>::bytes(key) <= Key_traits<Key>::max_bytes();
+}
+
+
+//TREE CONFIGURATION
+
+
+//chosen when the files are created and saved in their headers
+struct Tree_config
+{
+    unsigned int d;             //degree of the B-tree
+    unsigned int min_keys;
+    unsigned int max_keys;
+    bool bplus_tree;            //records only in leaves, leaves linked
+    unsigned int min_interior_keys;     //B+-tree upper pages hold only separators, so more of them fit in a page
+    unsigned int max_interior_keys;
+    unsigned int index_page_size;       //bytes taken by index page on disk
+    unsigned int data_page_records;     //how many records can be put in single data page
+    unsigned int data_page_size;        //bytes taken by data page on disk
+    bool compressed_pages;      //index pages are saved compressed
+    bool clustered;             //records are kept in B+-tree leaves, record pointers aren't used
+    bool sized_pages;           //number of keys in index page is limited by its bytes (compressed or with variable-length keys), limits above only bound it
+    unsigned int split_separators;      //most keys a page gets from a single split of its child (sized pages can be split into more than 2)
+};
+
+Tree_config tree_config;
 
 
 //NEEDED FORWARD DECLARATIONS
@@ -62,1459 +344,6471 @@ Data_page* get_data_page(unsigned int page_id, const string& filename);
 void write_data_page(unsigned int page_id, Data_page& page, const string& filename);
 void print_data_dat (const string& filename);
 pair<unsigned int, unsigned int> insert_rec_in_data_dat(Record rec);
+B_tree_record place_record(const Record& rec);
+void release_placed_record(const B_tree_record& rec);
+bool sides_valid(const Record& rec);
 void update_rec_in_data_dat (B_tree_record rec_to_change, Record new_rec);
 
 B_tree_page* get_index_page(unsigned int page_id, const string& filename);
+B_tree_page* pin_index_page(unsigned int page_id, const string& filename);
+B_tree_page* peek_index_page(unsigned int page_id);
+B_tree_page* find_index_page(unsigned int page_id);
+unsigned int read_ahead_index_pages(const vector<unsigned int>& page_ids, const string& filename);
+unsigned int read_ahead_data_pages(const vector<unsigned int>& page_ids, const string& filename);
+void release_index_page(B_tree_page* page);
 void write_index_page(unsigned int page_id, B_tree_page& page, const string& filename);
 
-void init_B_tree_page(B_tree_page *page);
+B_tree_page* new_index_page();
+Data_page* init_data_page();
 void free_index_page(unsigned int id);
 void remove_rec_from_data_dat(B_tree_record rec);
+bool data_dat_sparse();
+struct B_tree;
+void compact_data_dat(B_tree* tree);
+bool index_dat_sparse();
+void defragment_index_dat(B_tree* tree);
 void flush_all_buffers(const string& data_dat_filename, const string& index_dat_filename);
 
-
-//PAGE BUFFERS
-
-
-unordered_map<unsigned int, unique_ptr<B_tree_page>> index_buffer;
-unordered_map<unsigned int, Data_page> data_buffer;
+struct Page_file;
+Page_file* get_page_file(const string& filename);
+struct File_header;
+void write_file_header(Page_file* file, unsigned int magic, unsigned int root, bool clean);
+void save_tree_meta(unsigned int root, bool clean);
+bool read_file_header(Page_file* file, unsigned int magic, File_header& header);
+void store_data_page(Page_file* file, unsigned int page_id, const Data_page& page);
+bool load_data_page(Page_file* file, unsigned int page_id, Data_page& page);
+bool decode_index_page(unsigned int page_id, B_tree_page& page);
+void decode_data_page(Data_page& page);
+void close_all_page_files();
+Tree_config make_tree_config(unsigned int d, unsigned int data_page_records, bool bplus_tree, bool compressed_pages, bool clustered);
 
 
 //STRUCTS
 
 
-struct Record
-{
-    unsigned int key;
-    double sides[5];
-};
-
-struct B_tree_record
-{
-    unsigned int key;
-    unsigned int page_id;
-    unsigned int offset;
-};
-
-struct Data_page
-{
-    unsigned int id;
-    bool dirty;     //if it was modified in RAM
-    Record records[DATA_PAGE_SIZE];
-    unsigned int rec_num;   //number of records used
-    bool slot_free[DATA_PAGE_SIZE];     //to mark if the slot is occupied by a record
-
-};
-
-struct B_tree_page
+//file opened once and accessed with positioned reads/writes of whole pages
+//the first FILE_HEADER_SIZE bytes hold the file header, pages start after it
+struct Page_file
 {
-    unsigned int id;
-    B_tree_record keys[MAX_KEYS +1];    //one more in case of overflow
-    unsigned int keys_num;
-    unsigned int children_id[MAX_KEYS + 2];    //id of pages - one more in case of overflow
-    unsigned int parent_id;
-    bool dirty;
-    unsigned int next_free;
-    unsigned int pin_count;     //to mark currently used pages in the buffer
+    int fd = -1;
+    string filename;
+    unsigned int header_size = FILE_HEADER_SIZE;
 
-    bool is_leaf()
+    bool open_file(const string& name)
     {
-        return children_id[0] == UINT_MAX;
+        filename = name;
+        fd = open(name.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0)
+        {
+            cerr << "Error: Couldn't open " << name << ": " << strerror(errno) << endl;
+            return false;
+        }
+        return true;
     }
-
-    bool is_root()
+    //returns false on error or if the bytes lie (partially) beyond the end of the file
+    bool read_at(off_t pos, void* buffer, size_t size)
     {
-        return parent_id == UINT_MAX;
+        char* buf = static_cast<char*>(buffer);
+        size_t done = 0;
+        while (done < size)
+        {
+            ssize_t n = pread(fd, buf + done, size - done, pos + done);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                return false;
+            }
+            done += n;
+        }
+        return true;
     }
-    bool is_full()
+    bool write_at(off_t pos, const void* buffer, size_t size)
     {
-        return keys_num == MAX_KEYS;
+        const char* buf = static_cast<const char*>(buffer);
+        size_t done = 0;
+        while (done < size)
+        {
+            ssize_t n = pwrite(fd, buf + done, size - done, pos + done);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                cerr << "Error: Couldn't write to " << filename << ": " << strerror(errno) << endl;
+                return false;
+            }
+            done += n;
+        }
+        return true;
     }
-    bool has_free_slots()
+    bool read_page(unsigned int page_id, void* page, size_t page_size)
     {
-        return keys_num < MAX_KEYS;
+        return read_at(header_size + (off_t)page_id * page_size, page, page_size);
     }
-    bool is_overflown()
+    bool write_page(unsigned int page_id, const void* page, size_t page_size)
     {
-        return keys_num > MAX_KEYS;
+        return write_at(header_size + (off_t)page_id * page_size, page, page_size);
     }
-    bool is_underflown()
+    //pages one after another from first_page_id on - with as few (vectored) writes as the system takes
+    bool write_pages(unsigned int first_page_id, vector<iovec> pages, size_t page_size)
     {
-        if (is_root())
+        off_t pos = header_size + (off_t)first_page_id * page_size;
+        size_t first = 0;
+        while (first < pages.size())
         {
-            return keys_num==0;
+            ssize_t n = pwritev(fd, &pages[first], (int)min(pages.size() - first, (size_t)IOV_MAX), pos);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                cerr << "Error: Couldn't write to " << filename << ": " << strerror(errno) << endl;
+                return false;
+            }
+            pos += n;
+            while (n > 0)       //parts written whole are skipped, the one written partially goes on from where it stopped
+            {
+                if ((size_t)n >= pages[first].iov_len)
+                {
+                    n -= pages[first].iov_len;
+                    first++;
+                }
+                else
+                {
+                    pages[first].iov_base = static_cast<char*>(pages[first].iov_base) + n;
+                    pages[first].iov_len -= n;
+                    n = 0;
+                }
+            }
         }
-        return keys_num<MIN_KEYS;
+        return true;
     }
-    void print(int depth, int current_num)
+    bool read_header(void* header, size_t size)
     {
-        for(int i = 1; i<depth; i++)
-        {
-            cout<<"\t";
-        }
-        cout<<"Node "<<depth<<"."<<current_num<<" (page id: "<<id<<"):"<<endl;
-        for(int i = 1; i<depth; i++)
+        return read_at(0, header, size);
+    }
+    bool write_header(const void* header, size_t size)
+    {
+        return write_at(0, header, size);
+    }
+    bool sync_file()
+    {
+        if (fdatasync(fd) != 0)
         {
-            cout<<"\t";
+            cerr << "Error: Couldn't sync " << filename << ": " << strerror(errno) << endl;
+            return false;
         }
-        for (int i = 0; i<keys_num; i++)
+        return true;
+    }
+    off_t file_size()
+    {
+        off_t size = lseek(fd, 0, SEEK_END);
+        return size < 0 ? 0 : size;
+    }
+    void truncate_file()
+    {
+        if (ftruncate(fd, 0) != 0)
         {
-            cout<<keys[i].key<<" ";
+            cerr << "Error: Couldn't truncate " << filename << ": " << strerror(errno) << endl;
         }
-        cout<<endl;
-
-        if(!is_leaf())
+    }
+    //keeps the header and the first pages_num pages
+    void truncate_pages(unsigned int pages_num, size_t page_size)
+    {
+        if (ftruncate(fd, header_size + (off_t)pages_num * page_size) != 0)
         {
-            for(int i = 0; i<keys_num+1;i++)
-            {
-                B_tree_page* current_child = get_index_page(children_id[i], INDEX_DAT_FILENAME); 
-                current_child->print(depth+1, i+1);
-                current_child->pin_count--;
-            }
+            cerr << "Error: Couldn't truncate " << filename << ": " << strerror(errno) << endl;
         }
     }
-    //returns: UINT_MAX if not possible, id in parent.children_id array if possible
-    unsigned int compensation_possible()
+    void close_file()
     {
-        if(is_root())
+        if (fd >= 0)
         {
-            return UINT_MAX;      //compensation impossible for the root
+            close(fd);
+            fd = -1;
         }
-        B_tree_page* parent = get_index_page(parent_id, INDEX_DAT_FILENAME);
-        parent->pin_count--;
+    }
+};
 
-        //find position in children[] array
-        int i = 0;
-        while(i <= parent->keys_num && parent->children_id[i] != id)
-        {
-            i++;
-        }
+//reads of pages wanted together (read-ahead), handed to IO_THREADS threads so that their waits for the disk overlap
+struct Io_request
+{
+    Page_file* file;
+    unsigned int page_id;
+    vector<char> image;     //whole page
+    bool read = false;      //set when the image is read
+    unsigned long long ticket = 0;      //see Buffer_shard::start_reading()
+    unsigned int* left = nullptr;       //requests of the batch not done yet
+};
 
-        if(i > parent->keys_num)     //error backup - shouldn't happen
-        {
-            cerr << "Error: child not found in parent.\n";
-            return UINT_MAX;
-        }
-        if (i == 0)     //page is the first child
-        {
-            //check only right sibling
-            B_tree_page* sibling = get_index_page(parent->children_id[1], INDEX_DAT_FILENAME);
-            if ((is_overflown() && sibling->has_free_slots()) || (is_underflown() && sibling->keys_num > MIN_KEYS))
-            {
-                sibling->pin_count--;
-                return 1;
-            }
-            return UINT_MAX;
-        }
-        else if (i == parent->keys_num)      //page is the last child
+struct Io_engine
+{
+    vector<thread> workers;     //started by the first batch
+    mutex latch;
+    condition_variable work_ready;
+    condition_variable work_done;
+    vector<Io_request*> queue;
+    bool stopping = false;
+
+    ~Io_engine()
+    {
         {
-            //check only left sibling
-            B_tree_page* sibling = get_index_page(parent->children_id[i-1], INDEX_DAT_FILENAME);
-            if ((is_overflown() && sibling->has_free_slots()) || (is_underflown() && sibling->keys_num > MIN_KEYS))
-            {
-                sibling->pin_count--;
-                return i-1;
-            }
-            return UINT_MAX;
-        }
-        B_tree_page* sibling = get_index_page(parent->children_id[i-1], INDEX_DAT_FILENAME);      //left
-        sibling->pin_count--;
-        if ((is_overflown() && sibling->has_free_slots()) || (is_underflown() && sibling->keys_num > MIN_KEYS))
-        {   
-            return i-1;     //return left sibling
+            lock_guard<mutex> lock(latch);
+            stopping = true;
         }
-        else
+        work_ready.notify_all();
+        for (thread& worker : workers)
         {
-            sibling = get_index_page(parent->children_id[i+1], INDEX_DAT_FILENAME);      //right
-            if ((is_overflown() && sibling->has_free_slots()) || (is_underflown() && sibling->keys_num > MIN_KEYS))
-            {
-                sibling->pin_count--;
-                return i+1;     //return right sibling
-            }
-            return UINT_MAX;     //both siblings full/underflown
+            worker.join();
         }
     }
-    //returns id of wanted key in the page, -1 if not present
-    int bisection_search(unsigned int key)
-    {
-        int left = 0;
-        int right = keys_num-1;
 
-        while(left<=right)
+    void work()
+    {
+        unique_lock<mutex> lock(latch);
+        while (true)
         {
-            int mid = left + (right-left)/2;
-            if(keys[mid].key == key)
-            {
-                return mid;
-            }
-            else if (keys[mid].key < key)
+            work_ready.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (queue.empty())
             {
-                left = mid + 1;      //search in right half
+                return;
             }
-            else
+            Io_request* request = queue.back();
+            queue.pop_back();
+            lock.unlock();
+            request->read = request->file->read_page(request->page_id, request->image.data(), request->image.size());
+            lock.lock();
+            if (--*request->left == 0)
             {
-                right = mid - 1;     //search in left half
+                work_done.notify_all();
             }
         }
-        return -1;      //not found
     }
-    //sibling_id in the function is its id in children_id array
-    void compensate(unsigned int sibling_id)
-    {
-        B_tree_page* parent = get_index_page(parent_id, INDEX_DAT_FILENAME);
-        B_tree_page* sibling = get_index_page(parent->children_id[sibling_id], INDEX_DAT_FILENAME);
-        unsigned int all_keys_num = keys_num + sibling->keys_num + 1;        //1 comes from the parent
-        B_tree_record *all_keys = new B_tree_record [all_keys_num];       //temporary array to hold all the keys
-        unsigned int *all_children = new unsigned int [all_keys_num+1];     //temporary array to hold children
 
-        //checking if it's the right or left sibling and filling both temporary arrays
-        bool right_sibling = false;
-        if (keys[0].key < sibling->keys[0].key)
+    //reads the requests not read yet (images sized by the caller), returns when all of them are done
+    void read_pages(vector<Io_request>& requests)
+    {
+        unsigned int left = 0;
+        for (Io_request& request : requests)
         {
-            right_sibling = true;
+            left += request.read ? 0 : 1;
         }
-        if(right_sibling)   //right sibling
+        if (IO_THREADS == 0 || left < 2)
         {
-            int i = 0;
-            for(i = 0; i<keys_num; i++)
-            {
-                all_keys[i] = keys[i];
-                all_children[i] = children_id[i];
-            }
-            all_keys[keys_num] = parent->keys[sibling_id-1];    //the parent's key
-            all_children[keys_num] = children_id[keys_num];       //the last child from left sibling
-            int j = 0;
-            for (i = keys_num+1; i<all_keys_num; i++)
+            for (Io_request& request : requests)
             {
-                all_keys[i] = sibling->keys[j];
-                all_children[i] = sibling->children_id[j];
-                j++;
+                if (!request.read)
+                {
+                    request.read = request.file->read_page(request.page_id, request.image.data(), request.image.size());
+                }
             }
-            all_children[all_keys_num] = sibling->children_id[sibling->keys_num];     //the last child from the right sibling
+            return;
         }
-        else    //left sibling
+        unique_lock<mutex> lock(latch);
+        while (workers.size() < IO_THREADS)
         {
-            int i = 0;
-            for(i = 0; i<sibling->keys_num; i++)
-            {
-                all_keys[i] = sibling->keys[i];
-                all_children[i] = sibling->children_id[i];
-            }
-            all_keys[sibling->keys_num] = parent->keys[sibling_id];    //the parent's key
-            all_children[sibling->keys_num] = sibling->children_id[sibling->keys_num];       //the last child from the left sibling
-            int j = 0;
-            for (i = sibling->keys_num+1; i<all_keys_num; i++)
-            {
-                all_keys[i] = keys[j];
-                all_children[i] = children_id[j];
-                j++;
-            }
-            all_children[all_keys_num] = children_id[keys_num];     //the last child from the right sibling
+            workers.emplace_back(&Io_engine::work, this);
         }
-        unsigned int med = all_keys_num/2;          //median will go to the parent
-        unsigned int children_med = (all_keys_num+1)/2;
-        if (right_sibling)
+        for (Io_request& request : requests)
         {
-            //left
-            int i = 0;
-            for (i = 0; i<med; i++)
-            {
-                keys[i] = all_keys[i];
-                if(!is_leaf())
-                {
-                    children_id[i] = all_children[i];
-                }
-            }
-            if(!is_leaf())
-            {
-                children_id[med] = all_children[med];
-            }
-            keys_num = med;
-            //parent
-            parent->keys[sibling_id-1] = all_keys[med];
-            //right
-            int j = 0;
-            for (i = med+1; i<all_keys_num; i++)
-            {
-                sibling->keys[j] = all_keys[i];
-                if(!is_leaf())
-                {
-                    sibling->children_id[j] = all_children[i];
-                }
-                j++;
-            }
-            sibling->keys_num = all_keys_num - 1 - med;
-            if(!is_leaf())
+            if (!request.read)
             {
-                sibling->children_id[sibling->keys_num] = all_children[all_keys_num];
+                request.left = &left;
+                queue.push_back(&request);
             }
         }
-        else
+        work_ready.notify_all();
+        work_done.wait(lock, [&left] { return left == 0; });
+    }
+};
+
+Io_engine io_engine;
+
+//images of pages written by a flush (see write_page_image()) - gathered and then written in order of the pages,
+//adjacent pages of a file with a single vectored write
+struct Write_batch
+{
+    struct Image
+    {
+        Page_file* file;
+        unsigned int page_id;
+        size_t offset;      //in bytes
+        size_t size;
+    };
+
+    vector<char> bytes;
+    vector<Image> images;
+
+    void add(Page_file* file, unsigned int page_id, const char* image, size_t size)
+    {
+        images.push_back({file, page_id, bytes.size(), size});
+        bytes.insert(bytes.end(), image, image + size);
+    }
+
+    void write()
+    {
+        sort(images.begin(), images.end(), [](const Image& a, const Image& b)
         {
-            //left sibling
-            int i = 0;
-            for (i = 0; i<med; i++)
+            return a.file != b.file ? a.file < b.file : a.page_id < b.page_id;
+        });
+        vector<iovec> run;
+        for (size_t i = 0; i < images.size(); i++)
+        {
+            run.push_back({bytes.data() + images[i].offset, images[i].size});
+            bool run_ends = i + 1 == images.size() || images[i+1].file != images[i].file || images[i+1].page_id != images[i].page_id + 1
+                            || images[i+1].size != images[i].size;
+            if (run_ends)
             {
-                sibling->keys[i] = all_keys[i];
-                if(!is_leaf())
-                {
-                    sibling->children_id[i] = all_children[i];
+                images[i].file->write_pages(images[i].page_id + 1 - run.size(), run, images[i].size);
+                run.clear();
+            }
+        }
+        images.clear();
+        bytes.clear();
+    }
+};
+
+thread_local Write_batch* write_batch = nullptr;        //of the flush the thread is in the middle of
+
+#define     INDEX_FILE_MAGIC    0x49544242      //"BBTI"
+#define     DATA_FILE_MAGIC     0x44544242      //"BBTD"
+#define     FILE_VERSION        9       //2 - index pages without parent ids, 3 - keys of index pages apart from record pointers, 4 - compressed pages,
+                                        //5 - key type, 6 - free slots of data pages as bits, free-space map in its own file, 7 - clustered trees,
+                                        //8 - number of records in data.dat, 9 - number of free index pages
+#define     FREE_SPACE_MAP_MAGIC    0x46544242      //"BBTF"
+
+//saved at the beginning of index.dat and data.dat
+struct File_header
+{
+    unsigned int magic;
+    unsigned int version;
+    unsigned int page_size;     //bytes taken by a single page
+    unsigned int d;             //index.dat: degree of the B-tree
+    unsigned int data_page_records;     //data.dat: how many records can be put in single data page
+    unsigned int bplus_tree;    //index.dat: 1 if it's a B+-tree
+    unsigned int compressed_pages;      //index.dat: 1 if its pages are compressed
+    unsigned int key_type;      //Key_traits id of the keys
+    unsigned int clustered;     //index.dat: 1 if records are kept in the leaves
+    unsigned int clean;         //1 if the fields below describe the pages (files were closed properly or changes are in the log)
+    unsigned int root;          //index.dat: root page id, UINT_MAX if the tree is empty
+    unsigned int next_page_id;  //index.dat
+    unsigned int free_list_head;        //index.dat
+    unsigned int free_index_pages;      //index.dat: pages in the free list
+    unsigned int next_data_page_id;     //data.dat
+    unsigned int data_records;  //data.dat: live records
+};
+
+struct Record
+{
+    Key key;
+    double sides[5];
+};
+
+struct B_tree_record
+{
+    Key key;
+    unsigned int page_id;
+    unsigned int offset;
+    double sides[5] = {};        //clustered tree: the record itself instead of page_id and offset
+};
+
+//where the record of a key is in data.dat - index pages keep these apart from the keys
+struct Record_pointer
+{
+    unsigned int page_id;
+    unsigned int offset;
+};
+
+//arrays of index pages start at a cache line boundary - searching a page reads only the lines holding its keys
+template <typename T>
+struct Cache_line_allocator
+{
+    typedef T value_type;
+
+    Cache_line_allocator() = default;
+    template <typename U>
+    Cache_line_allocator(const Cache_line_allocator<U>&) {}
+
+    T* allocate(size_t n)
+    {
+        return static_cast<T*>(::operator new(n * sizeof(T), align_val_t(CACHE_LINE_BYTES)));
+    }
+    void deallocate(T* memory, size_t)
+    {
+        ::operator delete(memory, align_val_t(CACHE_LINE_BYTES));
+    }
+    template <typename U>
+    bool operator==(const Cache_line_allocator<U>&) const
+    {
+        return true;
+    }
+    template <typename U>
+    bool operator!=(const Cache_line_allocator<U>&) const
+    {
+        return false;
+    }
+};
+
+//how many items fill whole cache lines when at least count of them are needed
+unsigned int round_to_cache_lines(unsigned int count, size_t item_size)
+{
+    size_t per_line = CACHE_LINE_BYTES / item_size;
+    return (count + per_line - 1) / per_line * per_line;
+}
+
+//COMPRESSED_PAGES: page starts with id, keys_num, next_free, prev_leaf, next_leaf, leaf flag, the first key and width,
+//then differences of the keys from the first one, `width` bits each, then varints (7 bits in a byte, the highest bit set
+//if more bytes follow): leaf - page_id (difference from the previous one) and offset of every record,
+//upper page - children ids (difference from the previous one)
+#define     COMPRESSED_HEADER_BYTES     (7 * sizeof(unsigned int) + 1)
+#define     COMPRESSED_MAX_VARINT       5
+
+//differences can be negative - small ones of both signs are made small unsigned numbers
+unsigned int zigzag(unsigned int difference)
+{
+    return (difference << 1) ^ (0u - (difference >> 31));
+}
+
+unsigned int unzigzag(unsigned int value)
+{
+    return (value >> 1) ^ (0u - (value & 1));
+}
+
+unsigned int varint_size(unsigned int value)
+{
+    unsigned int size = 1;
+    while (value >= 0x80)
+    {
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
+
+unsigned int bit_width(unsigned int value)
+{
+    return value == 0 ? 0 : 32 - __builtin_clz(value);
+}
+
+//variable-length keys: page starts with id, keys_num, next_free, prev_leaf, next_leaf, leaf flag, then record pointers
+//(or records of a clustered tree) in a leaf or children, then a slot for every key (offset from the beginning of the page and length) - bytes of the keys are put
+//at the end of the page, the first key last
+#define     SLOTTED_HEADER_BYTES    (6 * sizeof(unsigned int))
+#define     SLOT_BYTES              (2 * sizeof(unsigned short))
+
+//bytes taken by a compressed or slotted page, counted while its keys (with their pointers or children) are added in order
+struct Page_bytes
+{
+    unsigned int keys_num = 0;
+    Key first_key = no_key;
+    Key last_key = no_key;
+    unsigned int key_bytes = 0;     //slotted page: slots and bytes of the keys
+    unsigned int id_bytes = 0;      //record pointers and children, varints in compressed page
+    unsigned int last_id = 0;       //page id of the last record pointer or child
+
+    void add_key(const Key& key)
+    {
+        if (!tree_config.compressed_pages)
+        {
+            key_bytes += SLOT_BYTES + Key_traits<Key>::bytes(key);
+        }
+        else if (keys_num == 0)
+        {
+            first_key = key;
+        }
+        else
+        {
+            last_key = key;
+        }
+        keys_num++;
+    }
+    void add_pointer(Record_pointer pointer)
+    {
+        if (!tree_config.compressed_pages)
+        {
+            id_bytes += tree_config.clustered ? sizeof(Record::sides) : sizeof(Record_pointer);
+            return;
+        }
+        id_bytes += varint_size(zigzag(pointer.page_id - last_id)) + varint_size(pointer.offset);
+        last_id = pointer.page_id;
+    }
+    void add_child(unsigned int child_id)
+    {
+        if (!tree_config.compressed_pages)
+        {
+            id_bytes += sizeof(unsigned int);
+            return;
+        }
+        id_bytes += varint_size(zigzag(child_id - last_id));
+        last_id = child_id;
+    }
+    unsigned int bytes()
+    {
+        if (!tree_config.compressed_pages)
+        {
+            return SLOTTED_HEADER_BYTES + key_bytes + id_bytes;
+        }
+        unsigned int width = keys_num > 1 ? bit_width(Key_traits<Key>::difference(first_key, last_key)) : 0;
+        return COMPRESSED_HEADER_BYTES + (keys_num * width + 7) / 8 + id_bytes;
+    }
+};
+
+//IN-PAGE KEY SEARCH
+//one page is searched by narrowing the range without branches down to a few keys, which are then compared
+//all at once - the number of keys smaller than the wanted one is the position of the key (or of the child to go down to)
+
+template <typename Int>
+unsigned int count_keys_less_scalar(const Int* keys, unsigned int n, Int key)
+{
+    unsigned int count = 0;
+    for (unsigned int i = 0; i < n; i++)
+    {
+        count += keys[i] < key;
+    }
+    return count;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+//SSE2 and AVX2 compare only signed ints - flipping the highest bit keeps the order of unsigned ones
+unsigned int count_keys_less_sse2(const unsigned int* keys, unsigned int n, unsigned int key)
+{
+    const __m128i flip = _mm_set1_epi32(INT_MIN);
+    const __m128i wanted = _mm_xor_si128(_mm_set1_epi32(key), flip);
+    unsigned int count = 0;
+    unsigned int i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128i loaded = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i));
+        __m128i less = _mm_cmpgt_epi32(wanted, _mm_xor_si128(loaded, flip));
+        count += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(less)));
+    }
+    return count + count_keys_less_scalar(keys + i, n - i, key);
+}
+
+__attribute__((target("avx2")))
+unsigned int count_keys_less_avx2(const unsigned int* keys, unsigned int n, unsigned int key)
+{
+    const __m256i flip = _mm256_set1_epi32(INT_MIN);
+    const __m256i wanted = _mm256_xor_si256(_mm256_set1_epi32(key), flip);
+    unsigned int count = 0;
+    unsigned int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256i loaded = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i));
+        __m256i less = _mm256_cmpgt_epi32(wanted, _mm256_xor_si256(loaded, flip));
+        count += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(less)));
+    }
+    return count + count_keys_less_sse2(keys + i, n - i, key);
+}
+
+//64-bit keys - without AVX2 they're compared one by one
+__attribute__((target("avx2")))
+unsigned int count_keys_less_avx2(const unsigned long long* keys, unsigned int n, unsigned long long key)
+{
+    const __m256i flip = _mm256_set1_epi64x(LLONG_MIN);
+    const __m256i wanted = _mm256_xor_si256(_mm256_set1_epi64x(key), flip);
+    unsigned int count = 0;
+    unsigned int i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i loaded = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i));
+        __m256i less = _mm256_cmpgt_epi64(wanted, _mm256_xor_si256(loaded, flip));
+        count += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(less)));
+    }
+    return count + count_keys_less_scalar(keys + i, n - i, key);
+}
+
+bool cpu_has_avx2()
+{
+    __builtin_cpu_init();       //needed before main
+    return __builtin_cpu_supports("avx2");
+}
+
+bool avx2_supported = cpu_has_avx2();
+
+#endif
+
+unsigned int count_keys_less(const unsigned int* keys, unsigned int n, unsigned int key)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (SIMD_KEY_SEARCH)
+    {
+        return avx2_supported ? count_keys_less_avx2(keys, n, key) : count_keys_less_sse2(keys, n, key);
+    }
+#endif
+    return count_keys_less_scalar(keys, n, key);
+}
+
+unsigned int count_keys_less(const unsigned long long* keys, unsigned int n, unsigned long long key)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (SIMD_KEY_SEARCH && avx2_supported)
+    {
+        return count_keys_less_avx2(keys, n, key);
+    }
+#endif
+    return count_keys_less_scalar(keys, n, key);
+}
+
+//position of the first key not smaller than key among n sorted keys (n if there's none)
+//any key type and order - the range is narrowed without branches down to a single key
+template <typename K, typename Compare>
+unsigned int lower_bound_key(const K* keys, unsigned int n, const K& key, Compare compare)
+{
+    if (n == 0)
+    {
+        return 0;
+    }
+    unsigned int base = 0;
+    while (n > 1)
+    {
+        unsigned int half = n / 2;
+        base = compare(keys[base + half], key) ? base + half : base;     //conditional move, not a jump
+        n -= half;
+    }
+    return base + (compare(keys[base], key) ? 1 : 0);
+}
+
+//integer keys in their natural order - the last SEARCH_WINDOW keys are compared at once
+template <typename Int>
+unsigned int lower_bound_integer_key(const Int* keys, unsigned int n, Int key)
+{
+    unsigned int base = 0;
+    while (n > SEARCH_WINDOW)
+    {
+        unsigned int half = n / 2;
+        base = keys[base + half] < key ? base + half : base;
+        n -= half;
+    }
+    return base + count_keys_less(keys + base, n, key);
+}
+
+template <>
+unsigned int lower_bound_key(const unsigned int* keys, unsigned int n, const unsigned int& key, less<unsigned int>)
+{
+    return lower_bound_integer_key(keys, n, key);
+}
+
+template <>
+unsigned int lower_bound_key(const unsigned long long* keys, unsigned int n, const unsigned long long& key, less<unsigned long long>)
+{
+    return lower_bound_integer_key(keys, n, key);
+}
+
+//sizes of the arrays depend on tree_config, only id, rec_num, records and free_slots are saved on disk
+struct Data_page
+{
+    unsigned int id;
+    bool dirty = false;     //if it was modified in RAM
+    vector<Record> records;
+    unsigned int rec_num;   //number of records used
+    vector<unsigned long long> free_slots;      //bit per slot, set if the slot isn't occupied by a record
+    unsigned int pin_count;     //to mark currently used pages in the buffer
+
+    void init_storage()
+    {
+        records.resize(tree_config.data_page_records);
+        free_slots.resize((tree_config.data_page_records + 63) / 64);
+    }
+    bool slot_free(unsigned int slot) const
+    {
+        return (free_slots[slot / 64] >> (slot % 64)) & 1;
+    }
+    void set_slot_free(unsigned int slot, bool free)
+    {
+        if (free)
+        {
+            free_slots[slot / 64] |= 1ull << (slot % 64);
+        }
+        else
+        {
+            free_slots[slot / 64] &= ~(1ull << (slot % 64));
+        }
+    }
+    void free_all_slots()
+    {
+        fill(free_slots.begin(), free_slots.end(), 0);
+        for (unsigned int slot = 0; slot < tree_config.data_page_records; slot++)
+        {
+            set_slot_free(slot, true);
+        }
+    }
+    //UINT_MAX if the page is full
+    unsigned int first_free_slot() const
+    {
+        for (unsigned int i = 0; i < free_slots.size(); i++)
+        {
+            if (free_slots[i] != 0)
+            {
+                return i * 64 + __builtin_ctzll(free_slots[i]);
+            }
+        }
+        return UINT_MAX;
+    }
+};
+
+//data pages with at least one free slot, bit per page - a summary bit marks every word of the map that isn't 0,
+//so the first page with room is found by looking at a few words and freeing a slot only sets a bit
+struct Free_space_map
+{
+    vector<unsigned long long> words;
+    vector<unsigned long long> summary;
+    unsigned int first_summary = 0;     //summary words before it are 0
+    bool valid = true;      //false if the map has to be rebuilt from data pages (files were recovered from the log)
+
+    void clear()
+    {
+        words.clear();
+        summary.clear();
+        first_summary = 0;
+        valid = true;
+    }
+    bool has_free_slot(unsigned int page_id) const
+    {
+        return page_id / 64 < words.size() && ((words[page_id / 64] >> (page_id % 64)) & 1);
+    }
+    void set(unsigned int page_id, bool has_free_slot)
+    {
+        unsigned int word = page_id / 64;
+        if (word >= words.size())
+        {
+            if (!has_free_slot)
+            {
+                return;
+            }
+            words.resize(word + 1, 0);
+            summary.resize(word / 64 + 1, 0);
+        }
+        if (has_free_slot)
+        {
+            words[word] |= 1ull << (page_id % 64);
+            summary[word / 64] |= 1ull << (word % 64);
+            first_summary = min(first_summary, word / 64);
+            return;
+        }
+        words[word] &= ~(1ull << (page_id % 64));
+        if (words[word] == 0)
+        {
+            summary[word / 64] &= ~(1ull << (word % 64));
+        }
+    }
+    //lowest id of a page with a free slot, UINT_MAX if there's none
+    unsigned int first()
+    {
+        for (; first_summary < summary.size(); first_summary++)
+        {
+            if (summary[first_summary] != 0)
+            {
+                unsigned int word = first_summary * 64 + __builtin_ctzll(summary[first_summary]);
+                return word * 64 + __builtin_ctzll(words[word]);
+            }
+        }
+        return UINT_MAX;
+    }
+    //map read from the disk
+    void assign(const vector<unsigned long long>& saved_words)
+    {
+        clear();
+        words = saved_words;
+        summary.assign((words.size() + 63) / 64, 0);
+        for (unsigned int word = 0; word < words.size(); word++)
+        {
+            if (words[word] != 0)
+            {
+                summary[word / 64] |= 1ull << (word % 64);
+            }
+        }
+    }
+};
+
+Free_space_map free_space_map;
+mutex data_latch;       //data pages, the free-space map and the counters of data.dat are used by concurrent operations one at a time
+
+//pages passed on the way from the root down to the page being changed - pages don't keep their parent's id,
+//so splits, merges and compensations find the parent (and the page's position in it) here
+struct B_tree_path
+{
+    struct Step
+    {
+        unsigned int page_id;
+        unsigned int child;     //position in children_id the path goes through, UINT_MAX on the last page
+    };
+
+    vector<Step> steps;     //steps[0] is the root
+    unsigned int root;      //root of the tree - changes when the root is split or becomes empty
+
+    void clear(unsigned int root_id)
+    {
+        steps.clear();
+        root = root_id;
+    }
+    void push(unsigned int page_id)
+    {
+        steps.push_back({page_id, UINT_MAX});
+    }
+    //new root above the old one
+    void push_root(unsigned int page_id)
+    {
+        steps.insert(steps.begin(), {page_id, 0});
+        root = page_id;
+    }
+};
+
+//keys and children of a page being split (or merged), kept between operations so that their memory is reused -
+//one for every level, a split of the page passes separators to its parent, which may need its own all_keys to split too
+struct Split_scratch
+{
+    vector<B_tree_record> all_keys;
+    vector<unsigned int> all_children;
+    vector<B_tree_record> separators;       //of the new pages, passed to the parent
+    vector<unsigned int> new_children;
+};
+
+//pages below the root have at least 2 children and page ids are unsigned ints, so there are at most 33 levels
+thread_local Split_scratch split_scratch[33];
+
+//reader/writer latch of an index page in the buffer - a copy of the page (made outside of the buffer) gets its own one
+struct Page_latch
+{
+    shared_mutex latch;
+
+    Page_latch() {}
+    Page_latch(const Page_latch&) {}
+    Page_latch& operator=(const Page_latch&)
+    {
+        return *this;
+    }
+    void lock(bool exclusive)
+    {
+        if (exclusive)
+        {
+            latch.lock();
+        }
+        else
+        {
+            latch.lock_shared();
+        }
+    }
+    void unlock(bool exclusive)
+    {
+        if (exclusive)
+        {
+            latch.unlock();
+        }
+        else
+        {
+            latch.unlock_shared();
+        }
+    }
+};
+
+//pin count of an index page - pages are pinned and unpinned by concurrent operations, a copy of the page only takes the value
+struct Pin_count
+{
+    atomic<unsigned int> value;
+
+    Pin_count() : value(0) {}
+    Pin_count(const Pin_count& other) : value(other.value.load()) {}
+    Pin_count& operator=(const Pin_count& other)
+    {
+        value = other.value.load();
+        return *this;
+    }
+    Pin_count& operator=(unsigned int count)
+    {
+        value = count;
+        return *this;
+    }
+    operator unsigned int() const
+    {
+        return value;
+    }
+    unsigned int operator++(int)
+    {
+        return value++;
+    }
+    unsigned int operator--(int)
+    {
+        return value--;
+    }
+};
+
+//field of a page that other threads may be changing at the same time - read as a relaxed atomic, it's used only once
+//the page's version validates (see B_tree::search_optimistic()), string keys are never read that way
+template <typename T>
+T load_relaxed(const T& field)
+{
+    if constexpr (is_trivially_copyable<T>::value)
+    {
+        T value;
+        __atomic_load(&field, &value, __ATOMIC_RELAXED);
+        return value;
+    }
+    else
+    {
+        return field;
+    }
+}
+
+//version of an index page in the buffer (or of the whole tree) - odd while it's being changed, so a reader that doesn't
+//latch it can tell if what it read in between is consistent (see B_tree::search_optimistic())
+//a copy of the page doesn't take it - the frame keeps counting when pages are loaded into it
+struct Version_counter
+{
+    atomic<unsigned long long> value;
+
+    Version_counter() : value(0) {}
+    Version_counter(const Version_counter&) : value(0) {}
+    Version_counter& operator=(const Version_counter&)
+    {
+        return *this;
+    }
+    //odd if a change is in progress
+    unsigned long long read() const
+    {
+        return value.load(memory_order_acquire);
+    }
+    //nothing was changed since read() returned version
+    bool validate(unsigned long long version) const
+    {
+        atomic_thread_fence(memory_order_acquire);
+        return value.load(memory_order_relaxed) == version;
+    }
+    //changes are made by one thread at a time (holding the latch exclusively)
+    void begin_change()
+    {
+        value.store(value.load(memory_order_relaxed) + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+    }
+    void end_change()
+    {
+        value.store(value.load(memory_order_relaxed) + 1, memory_order_release);
+    }
+};
+
+//sizes of the arrays depend on tree_config (rounded up to whole cache lines), dirty, pin_count, latch and version aren't saved on disk
+//keys are kept apart from the record pointers and children, so searching the page reads nothing but keys
+struct B_tree_page
+{
+    unsigned int id = UINT_MAX;
+    vector<Key, Cache_line_allocator<Key>> keys;       //max_keys + 1, one more in case of overflow
+    vector<Record_pointer, Cache_line_allocator<Record_pointer>> pointers;     //records of the keys, UINT_MAX in B+-tree upper pages
+    vector<double, Cache_line_allocator<double>> sides;     //clustered tree: 5 sides of every record of a leaf, empty otherwise
+    unsigned int keys_num = 0;
+    vector<unsigned int, Cache_line_allocator<unsigned int>> children_id;      //id of pages - max_keys + 2, one more in case of overflow
+    bool dirty = false;
+    unsigned int next_free = UINT_MAX;
+    Pin_count pin_count;        //to mark currently used pages in the buffer
+    Page_latch latch;           //held by operations using the page (latch crabbing), see get_index_page()
+    Version_counter version;    //changed with the latch held exclusively and when the frame gets another page
+    unsigned int prev_leaf = UINT_MAX;     //B+-tree leaves only, UINT_MAX otherwise
+    unsigned int next_leaf = UINT_MAX;
+
+    void init_storage()
+    {
+        unsigned int most_keys = max(tree_config.max_keys, tree_config.max_interior_keys);
+        unsigned int capacity = round_to_cache_lines(most_keys + 1, min(sizeof(Key), sizeof(Record_pointer)));     //whole lines of pointers too
+        keys.resize(capacity, no_key);
+        pointers.resize(capacity, Record_pointer{UINT_MAX, UINT_MAX});
+        sides.resize(tree_config.clustered ? capacity * 5 : 0);
+        children_id.resize(round_to_cache_lines(most_keys + 2, sizeof(unsigned int)), UINT_MAX);
+    }
+
+    B_tree_record record(unsigned int i)
+    {
+        B_tree_record rec = {keys[i], pointers[i].page_id, pointers[i].offset};
+        if (!sides.empty())
+        {
+            copy_n(&sides[i * 5], 5, rec.sides);
+        }
+        return rec;
+    }
+    void set_record(unsigned int i, const B_tree_record& rec)
+    {
+        keys[i] = rec.key;
+        pointers[i] = {rec.page_id, rec.offset};
+        if (!sides.empty())
+        {
+            copy_n(rec.sides, 5, &sides[i * 5]);
+        }
+    }
+    void clear_record(unsigned int i)
+    {
+        keys[i] = no_key;
+        pointers[i] = {UINT_MAX, UINT_MAX};
+    }
+
+    //empty page: no keys, no children, not linked with other pages
+    void reset()
+    {
+        init_storage();
+        keys_num = 0;
+        next_free = UINT_MAX;
+        prev_leaf = UINT_MAX;
+        next_leaf = UINT_MAX;
+        fill(keys.begin(), keys.end(), no_key);
+        fill(pointers.begin(), pointers.end(), Record_pointer{UINT_MAX, UINT_MAX});
+        fill(children_id.begin(), children_id.end(), UINT_MAX);
+    }
+
+    bool is_leaf()
+    {
+        return children_id[0] == UINT_MAX;
+    }
+
+    //B+-tree leaves keep the records - only there keys aren't copies of separators
+    bool is_bplus_leaf()
+    {
+        return tree_config.bplus_tree && is_leaf();
+    }
+    unsigned int max_keys()
+    {
+        return is_leaf() ? tree_config.max_keys : tree_config.max_interior_keys;
+    }
+    unsigned int min_keys()
+    {
+        return is_leaf() ? tree_config.min_keys : tree_config.min_interior_keys;
+    }
+    bool is_full()
+    {
+        return keys_num == max_keys();
+    }
+    bool has_free_slots()
+    {
+        return keys_num < max_keys();
+    }
+    //bytes the page takes when it's compressed or slotted
+    unsigned int encoded_size() const
+    {
+        return page_bytes().bytes();
+    }
+    Page_bytes page_bytes() const
+    {
+        Page_bytes size;
+        bool leaf = children_id[0] == UINT_MAX;
+        for (unsigned int i = 0; i < keys_num; i++)
+        {
+            size.add_key(keys[i]);
+            if (leaf)
+            {
+                size.add_pointer(pointers[i]);
+            }
+            else
+            {
+                size.add_child(children_id[i]);
+            }
+        }
+        if (!leaf)
+        {
+            size.add_child(children_id[keys_num]);
+        }
+        return size;
+    }
+    bool fits()
+    {
+        return !tree_config.sized_pages || encoded_size() <= tree_config.index_page_size;
+    }
+    bool is_overflown()
+    {
+        return keys_num > max_keys() || !fits();
+    }
+    bool is_underflown(bool root)
+    {
+        if (root)
+        {
+            return keys_num==0;
+        }
+        return keys_num<min_keys();
+    }
+    //the page takes keys from a split of its child without being split itself (or compensated) - an insert going down
+    //through it doesn't have to keep the pages above latched
+    bool safe_for_insert()
+    {
+        unsigned int spare = tree_config.split_separators;
+        if (keys_num + spare > max_keys())
+        {
+            return false;
+        }
+        if (!tree_config.sized_pages)
+        {
+            return true;
+        }
+        Page_bytes size = page_bytes();
+        unsigned int worst_bytes;
+        if (tree_config.compressed_pages)
+        {
+            //keys may become as wide as they can be, a new key's varints also change the difference of the next one
+            worst_bytes = COMPRESSED_HEADER_BYTES + (keys_num + spare) * sizeof(Key) + size.id_bytes + spare * 3 * COMPRESSED_MAX_VARINT;
+        }
+        else
+        {
+            worst_bytes = size.bytes() + spare * (SLOT_BYTES + Key_traits<Key>::max_bytes() + (tree_config.clustered ? sizeof(Record::sides) : sizeof(Record_pointer)));
+        }
+        return worst_bytes <= tree_config.index_page_size;
+    }
+    void print(int depth, int current_num)
+    {
+        for(int i = 1; i<depth; i++)
+        {
+            cout<<"\t";
+        }
+        cout<<"Node "<<depth<<"."<<current_num<<" (page id: "<<id<<"):"<<endl;
+        for(int i = 1; i<depth; i++)
+        {
+            cout<<"\t";
+        }
+        for (int i = 0; i<keys_num; i++)
+        {
+            cout<<keys[i]<<" ";
+        }
+        cout<<endl;
+
+        if(!is_leaf())
+        {
+            for(int i = 0; i<keys_num+1;i++)
+            {
+                B_tree_page* current_child = get_index_page(children_id[i], INDEX_DAT_FILENAME); 
+                current_child->print(depth+1, i+1);
+                release_index_page(current_child);
+            }
+        }
+    }
+    //level - position of the page in path
+    //returns: UINT_MAX if not possible, id in parent.children_id array if possible
+    unsigned int compensation_possible(B_tree_path& path, unsigned int level)
+    {
+        if(level == 0)
+        {
+            return UINT_MAX;      //compensation impossible for the root
+        }
+        if(tree_config.sized_pages)
+        {
+            return UINT_MAX;      //keys moved by number could make a page too big - pages are split and merged only
+        }
+        B_tree_page* parent = get_index_page(path.steps[level-1].page_id, INDEX_DAT_FILENAME);
+
+        //position in children[] array
+        int i = path.steps[level-1].child;
+        //parent is unpinned, so it can be evicted while loading siblings - remembering what's needed
+        unsigned int parent_keys_num = parent->keys_num;
+        bool found = i <= parent_keys_num && parent->children_id[i] == id;
+        unsigned int left_id = (i > 0 && i <= parent_keys_num) ? parent->children_id[i-1] : UINT_MAX;
+        unsigned int right_id = (i < parent_keys_num) ? parent->children_id[i+1] : UINT_MAX;
+        release_index_page(parent);
+
+        if(!found)     //error backup - shouldn't happen
+        {
+            cerr << "Error: child not found in parent.\n";
+            return UINT_MAX;
+        }
+        if (i == 0)     //page is the first child
+        {
+            //check only right sibling
+            return can_compensate_with(right_id) ? 1 : UINT_MAX;
+        }
+        else if (i == parent_keys_num)      //page is the last child
+        {
+            //check only left sibling
+            return can_compensate_with(left_id) ? i-1 : UINT_MAX;
+        }
+        if (can_compensate_with(left_id))
+        {   
+            return i-1;     //return left sibling
+        }
+        else
+        {
+            return can_compensate_with(right_id) ? i+1 : UINT_MAX;     //right sibling, UINT_MAX if both are full/underflown
+        }
+    }
+    //the sibling is released before returning - it's read while it's still pinned (and latched)
+    bool can_compensate_with(unsigned int sibling_page_id)
+    {
+        B_tree_page* sibling = get_index_page(sibling_page_id, INDEX_DAT_FILENAME);
+        bool possible = (is_overflown() && sibling->has_free_slots()) || (is_underflown(false) && sibling->keys_num > sibling->min_keys());
+        release_index_page(sibling);
+        return possible;
+    }
+    //key put into the parent for the record - B+-tree separators don't point to records
+    B_tree_record separator_of(B_tree_record rec)
+    {
+        if (is_bplus_leaf())
+        {
+            return {rec.key, UINT_MAX, UINT_MAX};
+        }
+        return rec;
+    }
+    //returns position of the first key >= key (keys_num if there's none) - it's also the child to go down to,
+    //found - if the key at the position is the wanted one
+    unsigned int search(const Key& key, bool& found)
+    {
+        unsigned int i = lower_bound_key(keys.data(), keys_num, key, Key_compare());
+        found = i < keys_num && !key_less(key, keys[i]);
+        return i;
+    }
+    //sibling_id in the function is its id in children_id array
+    //keys are moved between the pages (through the parent) in place, the left page ends up with half of them
+    void compensate(unsigned int sibling_id, B_tree_path& path, unsigned int level)
+    {
+        B_tree_page* parent = get_index_page(path.steps[level-1].page_id, INDEX_DAT_FILENAME);
+        B_tree_page* sibling = get_index_page(parent->children_id[sibling_id], INDEX_DAT_FILENAME);
+        //B+-tree leaves don't take the parent's key - it's only a copy of the first key of the right page
+        unsigned int separator = is_bplus_leaf() ? 0 : 1;
+        unsigned int all_keys_num = keys_num + sibling->keys_num + separator;        //separator comes from the parent
+        unsigned int med = all_keys_num/2;          //keys left in the left page, the next one goes to the parent
+
+        //checking if it's the right or left sibling
+        bool right_sibling = sibling_id > 0 && parent->children_id[sibling_id-1] == id;
+        B_tree_page* left = right_sibling ? this : sibling;
+        B_tree_page* right = right_sibling ? sibling : this;
+        unsigned int parent_pos = right_sibling ? sibling_id-1 : sibling_id;        //key between the pages
+        bool leaf = is_leaf();
+
+        if(left->keys_num > med)        //keys go from the left page to the right one
+        {
+            unsigned int moved = left->keys_num - med;      //keys (and children) the right page gets, one of the keys from the parent
+            for(int j = right->keys_num - 1; j >= 0; j--)
+            {
+                right->set_record(j + moved, right->record(j));
+            }
+            if(!leaf)
+            {
+                for(int j = right->keys_num; j >= 0; j--)
+                {
+                    right->children_id[j + moved] = right->children_id[j];
+                }
+            }
+            if(separator)
+            {
+                right->set_record(moved - 1, parent->record(parent_pos));
+                for(unsigned int j = 0; j + 1 < moved; j++)
+                {
+                    right->set_record(j, left->record(med + 1 + j));
+                }
+                parent->set_record(parent_pos, left->record(med));
+            }
+            else
+            {
+                for(unsigned int j = 0; j < moved; j++)
+                {
+                    right->set_record(j, left->record(med + j));
+                }
+                parent->set_record(parent_pos, separator_of(right->record(0)));
+            }
+            if(!leaf)
+            {
+                for(unsigned int j = 0; j < moved; j++)
+                {
+                    right->children_id[j] = left->children_id[med + 1 + j];
+                    left->children_id[med + 1 + j] = UINT_MAX;
+                }
+            }
+            for(unsigned int j = med; j < left->keys_num; j++)
+            {
+                left->clear_record(j);     //clearing spots
+            }
+            right->keys_num += moved;
+            left->keys_num = med;
+        }
+        else if(left->keys_num < med)       //keys go from the right page to the left one
+        {
+            unsigned int moved = med - left->keys_num;      //keys (and children) leaving the right page, the last key goes to the parent
+            if(separator)
+            {
+                left->set_record(left->keys_num, parent->record(parent_pos));
+                for(unsigned int j = 1; j < moved; j++)
+                {
+                    left->set_record(left->keys_num + j, right->record(j - 1));
+                }
+                parent->set_record(parent_pos, right->record(moved - 1));
+            }
+            else
+            {
+                for(unsigned int j = 0; j < moved; j++)
+                {
+                    left->set_record(left->keys_num + j, right->record(j));
+                }
+            }
+            if(!leaf)
+            {
+                for(unsigned int j = 0; j < moved; j++)
+                {
+                    left->children_id[left->keys_num + 1 + j] = right->children_id[j];
+                }
+            }
+            for(unsigned int j = moved; j < right->keys_num; j++)
+            {
+                right->set_record(j - moved, right->record(j));
+            }
+            if(!leaf)
+            {
+                for(unsigned int j = moved; j <= right->keys_num; j++)
+                {
+                    right->children_id[j - moved] = right->children_id[j];
+                }
+            }
+            right->keys_num -= moved;
+            for(unsigned int j = right->keys_num; j < right->keys_num + moved; j++)
+            {
+                right->clear_record(j);     //clearing spots
+                if(!leaf)
+                {
+                    right->children_id[j + 1] = UINT_MAX;
+                }
+            }
+            if(!separator)
+            {
+                parent->set_record(parent_pos, separator_of(right->record(0)));
+            }
+            left->keys_num = med;
+        }
+
+        dirty = true;
+        sibling->dirty = true;
+        parent->dirty = true;
+        release_index_page(parent);
+        release_index_page(sibling);
+    }
+    void split(B_tree_path& path, unsigned int level)
+    {
+        if(!is_overflown())
+        {
+            cout<<"Error: split() function called on a wrong node!"<<endl;          //backup just in case
+            return;
+        }
+        if(tree_config.sized_pages)
+        {
+            //halves of a compressed or slotted page don't have to fit - it's split into as many pages as needed
+            vector<B_tree_record>& all_keys = split_scratch[level].all_keys;
+            vector<unsigned int>& all_children = split_scratch[level].all_children;
+            all_keys.clear();
+            for(unsigned int i = 0; i < keys_num; i++)
+            {
+                all_keys.push_back(record(i));
+            }
+            all_children.assign(children_id.begin(), children_id.begin() + keys_num + 1);
+            split_many(all_keys, all_children, path, level);
+            return;
+        }
+
+        //filling new page - it's created in the buffer and saved when evicted or flushed
+        B_tree_page* new_page = new_index_page();        //it's going to be page on the right side
+        if(!new_page)
+        {
+            return;
+        }
+        unsigned int med = keys_num / 2;
+        //the median goes up, B+-tree leaf keeps it as the first key of the new page and gives the parent a copy
+        unsigned int up = is_bplus_leaf() ? 0 : 1;
+        B_tree_record separator = separator_of(record(med));
+        for(int i = 0; i<keys_num-med-up;i++)
+        {
+            new_page->set_record(i, record(med+up+i));        //moving keys to the new page
+            new_page->children_id[i] = children_id[med+up+i];
+            clear_record(med+up+i);       //clearing spot
+            children_id[med+up+i] = UINT_MAX;
+        }
+        new_page->keys_num = keys_num - med - up;
+        new_page->children_id[new_page->keys_num] =children_id[keys_num];       //last child covered 
+        children_id[keys_num] = UINT_MAX;
+        clear_record(med);
+        keys_num = med;
+
+        if(is_bplus_leaf())
+        {
+            //new page goes between this one and its right neighbour in the chain of leaves
+            new_page->prev_leaf = id;
+            new_page->next_leaf = next_leaf;
+            if(next_leaf != UINT_MAX)
+            {
+                B_tree_page* neighbour = get_index_page(next_leaf, INDEX_DAT_FILENAME);
+                neighbour->prev_leaf = new_page->id;
+                neighbour->dirty = true;
+                release_index_page(neighbour);
+            }
+            next_leaf = new_page->id;
+        }
+
+        dirty = true;
+        new_page->dirty = true;
+        unsigned int new_page_id = new_page->id;
+        release_index_page(new_page);
+
+        //moving key to the parent and connecting the parent with the new page
+        B_tree_page* parent;
+        if(level > 0)
+        {
+            parent = get_index_page(path.steps[level-1].page_id, INDEX_DAT_FILENAME);
+            int i = path.steps[level-1].child;      //index of the page in the children_id array of the parent
+            for(int j = parent->keys_num; j>i; j--)
+            {
+                parent->set_record(j, parent->record(j-1));
+                parent->children_id[j+1] = parent->children_id[j];      //moving all keys and children to the right side
+            }
+            parent->children_id[i+1] = new_page_id;      //adding new page as a child
+            parent->set_record(i, separator);
+            parent->keys_num += 1;
+            parent->dirty = true;
+
+            //overflow
+            if(parent->is_overflown())
+            {
+                unsigned int free_sibling_id = parent->compensation_possible(path, level-1);
+                if(free_sibling_id != UINT_MAX)
+                {
+                    parent->compensate(free_sibling_id, path, level-1);
+                }
+                else
+                {
+                    parent->split(path, level-1);
+                }
+            }
+        }
+        else
+        {
+            parent = new_index_page();
+            if(!parent)
+            {
+                return;
+            }
+            parent->set_record(0, separator);
+            path.push_root(parent->id);
+            parent->children_id[0] = id;
+            parent->children_id[1] = new_page_id;
+            parent->keys_num = 1;
+        }
+        release_index_page(parent);
+    }
+    void insert(B_tree_record rec, B_tree_path& path, unsigned int level)
+    {
+        dirty = true;
+        bool found;
+        int i = search(rec.key, found);
+        for(int j = keys_num; j>i; j--)
+        {
+            set_record(j, record(j-1));    //moving records to the right side
+        }
+        if(!is_leaf())
+        {
+            for(int j = keys_num+1; j>i+1; j--)
+            {
+                children_id[j] = children_id[j-1];    //moving children to the right side
+            }
+        }
+        set_record(i, rec);          //inserting new page
+        keys_num++;
+
+        //overflow
+        if(is_overflown())
+        {
+            unsigned int free_sibling_id = compensation_possible(path, level);
+            if(free_sibling_id != UINT_MAX)
+            {
+                compensate(free_sibling_id, path, level);
+            }
+            else
+            {
+                pin_count++;
+                split(path, level);
+                pin_count--;
+            }
+        }
+    }
+
+    //compressed or slotted pages: if all_keys (and all_children) spread among pages_num pages the way split_many does it fit in them
+    bool pieces_fit(const vector<B_tree_record>& all_keys, const vector<unsigned int>& all_children, unsigned int pages_num)
+    {
+        bool leaf = is_leaf();
+        unsigned int up = is_bplus_leaf() ? 0 : 1;
+        unsigned int kept = all_keys.size() - (pages_num - 1) * up;
+        unsigned int next = 0;
+        for(unsigned int p = 0; p < pages_num; p++)
+        {
+            unsigned int count = kept / pages_num + (p < kept % pages_num ? 1 : 0);
+            if(count > max_keys())
+            {
+                return false;
+            }
+            Page_bytes size;
+            for(unsigned int i = next; i < next + count; i++)
+            {
+                size.add_key(all_keys[i].key);
+                if(leaf)
+                {
+                    size.add_pointer({all_keys[i].page_id, all_keys[i].offset});
+                }
+                else
+                {
+                    size.add_child(all_children[i]);
+                }
+            }
+            if(!leaf)
+            {
+                size.add_child(all_children[next + count]);
+            }
+            if(size.bytes() > tree_config.index_page_size)
+            {
+                return false;
+            }
+            next += count + up;
+        }
+        return true;
+    }
+
+    //page got all_keys (and all_children) - more than it can hold - and is split into as many pages as needed at once,
+    //the parent gets all the new separators together
+    void split_many(const vector<B_tree_record>& all_keys, const vector<unsigned int>& all_children, B_tree_path& path, unsigned int level)
+    {
+        bool bplus_leaf = is_bplus_leaf();
+        bool leaf = is_leaf();
+        unsigned int all_keys_num = all_keys.size();
+        unsigned int up = bplus_leaf ? 0 : 1;       //keys going up, B+-tree leaf keeps them and gives the parent copies
+        unsigned int pages_num = bplus_leaf ? (all_keys_num + max_keys() - 1) / max_keys() : (all_keys_num + 1 + max_keys()) / (max_keys() + 1);
+        while(tree_config.sized_pages && !pieces_fit(all_keys, all_children, pages_num))
+        {
+            pages_num++;        //ends at the latest when the pages get at most 2 * min_keys keys each
+        }
+        unsigned int kept = all_keys_num - (pages_num - 1) * up;        //keys spread evenly among the pages
+
+        if(level == 0)
+        {
+            B_tree_page* new_root = new_index_page();
+            if(!new_root)
+            {
+                return;
+            }
+            new_root->children_id[0] = id;
+            path.push_root(new_root->id);
+            release_index_page(new_root);
+            level++;
+        }
+        vector<B_tree_record>& separators = split_scratch[level].separators;
+        vector<unsigned int>& new_children = split_scratch[level].new_children;
+        separators.clear();
+        new_children.clear();
+
+        //new pages are created in the buffer and filled in place - the next one is there before the current one is
+        //released, so that the leaves can be linked
+        unsigned int old_next_leaf = next_leaf;
+        unsigned int next = 0;      //first key of all_keys not placed yet
+        B_tree_page* page = this;
+        for(unsigned int p = 0; p < pages_num; p++)
+        {
+            B_tree_page* next_page = nullptr;
+            if(p + 1 < pages_num)
+            {
+                next_page = new_index_page();
+                if(!next_page)
+                {
+                    if(page != this)
+                    {
+                        release_index_page(page);
+                    }
+                    return;
+                }
+            }
+            unsigned int count = kept / pages_num + (p < kept % pages_num ? 1 : 0);
+            for(unsigned int i = 0; i < page->keys.size(); i++)
+            {
+                page->set_record(i, i < count ? all_keys[next+i] : B_tree_record{no_key, UINT_MAX, UINT_MAX});
+            }
+            for(unsigned int i = 0; i < page->children_id.size(); i++)
+            {
+                page->children_id[i] = (!leaf && i <= count) ? all_children[next+i] : UINT_MAX;
+            }
+            page->keys_num = count;
+            page->dirty = true;
+            next += count;
+            if(next_page)
+            {
+                if(bplus_leaf)
+                {
+                    page->next_leaf = next_page->id;
+                    next_page->prev_leaf = page->id;
+                }
+                separators.push_back(separator_of(all_keys[next]));
+                new_children.push_back(next_page->id);
+                next += up;
+            }
+            else if(bplus_leaf)
+            {
+                page->next_leaf = old_next_leaf;
+                if(old_next_leaf != UINT_MAX)
+                {
+                    B_tree_page* neighbour = get_index_page(old_next_leaf, INDEX_DAT_FILENAME);
+                    neighbour->prev_leaf = page->id;
+                    neighbour->dirty = true;
+                    release_index_page(neighbour);
+                }
+            }
+            if(page != this)
+            {
+                release_index_page(page);
+            }
+            page = next_page;
+        }
+
+        B_tree_page* parent = get_index_page(path.steps[level-1].page_id, INDEX_DAT_FILENAME);
+        parent->add_children(path.steps[level-1].child, separators, new_children, path, level-1);
+        release_index_page(parent);
+    }
+
+    //puts separators, each followed by a new child, right after child number pos
+    void add_children(unsigned int pos, const vector<B_tree_record>& separators, const vector<unsigned int>& new_children, B_tree_path& path, unsigned int level)
+    {
+        dirty = true;
+        unsigned int added = separators.size();
+        if(keys_num + added <= max_keys())
+        {
+            for(int j = keys_num - 1; j >= (int)pos; j--)
+            {
+                set_record(j+added, record(j));
+                children_id[j+1+added] = children_id[j+1];      //moving keys and children to the right side
+            }
+            for(unsigned int j = 0; j < added; j++)
+            {
+                set_record(pos+j, separators[j]);
+                children_id[pos+1+j] = new_children[j];
+            }
+            keys_num += added;
+            if(!fits())
+            {
+                split(path, level);     //compressed or slotted page got too big in bytes
+            }
+            return;
+        }
+        vector<B_tree_record>& all_keys = split_scratch[level].all_keys;
+        vector<unsigned int>& all_children = split_scratch[level].all_children;
+        all_keys.clear();
+        for(unsigned int j = 0; j < pos; j++)
+        {
+            all_keys.push_back(record(j));
+        }
+        all_keys.insert(all_keys.end(), separators.begin(), separators.end());
+        for(unsigned int j = pos; j < keys_num; j++)
+        {
+            all_keys.push_back(record(j));
+        }
+        all_children.assign(children_id.begin(), children_id.begin() + pos + 1);
+        all_children.insert(all_children.end(), new_children.begin(), new_children.end());
+        all_children.insert(all_children.end(), children_id.begin() + pos + 1, children_id.begin() + keys_num + 1);
+        split_many(all_keys, all_children, path, level);
+    }
+
+    //leaf gets many records (sorted, none of them in the tree yet) at once
+    void insert_many(const vector<B_tree_record>& recs, B_tree_path& path, unsigned int level)
+    {
+        vector<B_tree_record>& all_keys = split_scratch[level].all_keys;
+        all_keys.clear();
+        unsigned int i = 0;
+        for(const B_tree_record& rec : recs)
+        {
+            for(; i < keys_num && key_less(keys[i], rec.key); i++)
+            {
+                all_keys.push_back(record(i));
+            }
+            all_keys.push_back(rec);
+        }
+        for(; i < keys_num; i++)
+        {
+            all_keys.push_back(record(i));
+        }
+        dirty = true;
+        if(all_keys.size() <= max_keys())
+        {
+            for(unsigned int j = 0; j < all_keys.size(); j++)
+            {
+                set_record(j, all_keys[j]);
+            }
+            keys_num = all_keys.size();
+            if(!fits())
+            {
+                split(path, level);     //compressed or slotted page got too big in bytes
+            }
+            return;
+        }
+        vector<unsigned int>& all_children = split_scratch[level].all_children;
+        all_children.assign(all_keys.size() + 1, UINT_MAX);
+        split_many(all_keys, all_children, path, level);
+    }
+
+    //merge of compressed or slotted pages whose keys don't fit in one page: the parent loses the key between left and right
+    //and the right page, then the left page gets all the keys and is split - the parent doesn't lose keys in the end
+    void spread(const vector<B_tree_record>& all_keys, const vector<unsigned int>& all_children, B_tree_page* left, B_tree_page* right,
+                B_tree_page* parent, unsigned int left_child_id, B_tree_path& path, unsigned int level)
+    {
+        for(unsigned int j = left_child_id; j + 1 < parent->keys_num; j++)
+        {
+            parent->set_record(j, parent->record(j+1));
+            parent->children_id[j+1] = parent->children_id[j+2];
+        }
+        parent->keys_num--;
+        parent->clear_record(parent->keys_num);
+        parent->children_id[parent->keys_num+1] = UINT_MAX;
+        parent->dirty = true;
+        if(left->is_bplus_leaf())
+        {
+            left->next_leaf = right->next_leaf;     //split_many links the last new page with the next leaf
+        }
+        right->keys_num = 0;
+        path.steps[level-1].child = left_child_id;
+        path.steps[level].page_id = left->id;
+        left->split_many(all_keys, all_children, path, level);
+        free_index_page(right->id);     //after the split, so that it doesn't reuse the page still pinned by the caller
+    }
+
+    void merge(const string& filename, B_tree_path& path, unsigned int level)
+    {
+        B_tree_page* parent = get_index_page(path.steps[level-1].page_id, filename);
+
+        unsigned int sibling_id;
+
+        //position in children[] array
+        int i = path.steps[level-1].child;
+
+        //deciding whether we're taking left or right sibling
+        B_tree_page* sibling;
+        B_tree_page* left;
+        B_tree_page* right;
+        unsigned int left_child_id;     //IN PARENT->CHILDREN_ID, NOT PAGE ID
+        if(i<parent->keys_num)      //we take right sibling by default
+        {
+            sibling_id = i+1;
+            sibling = get_index_page(parent->children_id[sibling_id], filename);
+            left = this;
+            right = sibling;
+            left_child_id = sibling_id-1;
+        }
+        else
+        {
+            sibling_id = i-1;
+            sibling = get_index_page(parent->children_id[sibling_id], filename);
+            left = sibling;
+            right = this;
+            left_child_id = sibling_id;
+        }
+
+        //compressed or slotted pages: keys of both pages may not fit in one - then they are spread among as many pages as needed
+        if(tree_config.sized_pages)
+        {
+            vector<B_tree_record>& all_keys = split_scratch[level].all_keys;
+            vector<unsigned int>& all_children = split_scratch[level].all_children;
+            all_keys.clear();
+            all_children.clear();
+            for(unsigned int j = 0; j < left->keys_num; j++)
+            {
+                all_keys.push_back(left->record(j));
+            }
+            if(!left->is_bplus_leaf())
+            {
+                all_keys.push_back(parent->record(left_child_id));
+            }
+            for(unsigned int j = 0; j < right->keys_num; j++)
+            {
+                all_keys.push_back(right->record(j));
+            }
+            all_children.insert(all_children.end(), left->children_id.begin(), left->children_id.begin() + left->keys_num + 1);
+            all_children.insert(all_children.end(), right->children_id.begin(), right->children_id.begin() + right->keys_num + 1);
+            if(!left->pieces_fit(all_keys, all_children, 1))
+            {
+                spread(all_keys, all_children, left, right, parent, left_child_id, path, level);
+                release_index_page(sibling);
+                release_index_page(parent);
+                return;
+            }
+        }
+
+        //moving the parent's record and all records (and children) of the right page to the left one
+        //B+-tree leaves drop the parent's key instead, it's only a copy
+        unsigned int base = left->keys_num;
+        unsigned int separator = left->is_bplus_leaf() ? 0 : 1;
+        left->set_record(base, parent->record(left_child_id));
+        for(int j = 0; j < right->keys_num; j++)
+        {
+            left->set_record(base + separator + j, right->record(j));
+            right->clear_record(j);
+        }
+        if(!left->is_leaf())
+        {
+            for(int j = 0; j <= right->keys_num; j++)
+            {
+                left->children_id[base + 1 + j] = right->children_id[j];
+                right->children_id[j] = UINT_MAX;
+            }
+        }
+        left->keys_num = base + separator + right->keys_num;
+        left->dirty = true;
+        right->keys_num = 0;
+        if(left->is_bplus_leaf())
+        {
+            left->next_leaf = right->next_leaf;
+            if(right->next_leaf != UINT_MAX)
+            {
+                B_tree_page* neighbour = get_index_page(right->next_leaf, filename);
+                neighbour->prev_leaf = left->id;
+                neighbour->dirty = true;
+                release_index_page(neighbour);
+            }
+        }
+
+        //removing the parent's record and the right page from the parent
+        for(int j = left_child_id; j<parent->keys_num-1; j++)
+        {
+            parent->set_record(j, parent->record(j+1));
+            parent->children_id[j+1] = parent->children_id[j+2];
+        }
+        parent->keys_num--;
+        parent->clear_record(parent->keys_num);
+        parent->children_id[parent->keys_num+1] = UINT_MAX;
+        parent->dirty = true;
+
+        free_index_page(right->id);
+
+        if(parent->is_underflown(level-1 == 0))
+        {
+            if(level-1 == 0)
+            {
+                //empty root - the merged page becomes the new root
+                free_index_page(parent->id);
+                path.root = left->id;
+            }
+            else
+            {
+                unsigned int sibling_id = parent->compensation_possible(path, level-1);
+                if(sibling_id != UINT_MAX)
+                {
+                    parent->compensate(sibling_id, path, level-1);
+                }
+                else
+                {
+                    parent->merge(filename, path, level-1);
+                }
+            }
+        }
+
+        release_index_page(sibling);
+        release_index_page(parent);
+    }
+};
+
+//record the index record points to (clustered tree: the one it holds), false if it can't be read
+//optimistic: b_rec was found without latches - the slot could have been freed (and taken by another key) since,
+//then it's quietly not read
+bool fetch_record(const B_tree_record& b_rec, const string& data_filename, Record& r, bool optimistic = false)
+{
+    if (tree_config.clustered)
+    {
+        r.key = b_rec.key;
+        copy_n(b_rec.sides, 5, r.sides);
+        return true;
+    }
+    if (b_rec.offset >= tree_config.data_page_records)
+    {
+        cerr << "Error: offset out of range\n";
+        return false;
+    }
+
+    lock_guard<mutex> lock(data_latch);
+    Data_page* dpage = get_data_page(b_rec.page_id, data_filename);
+    if (!dpage)
+    {
+        cerr << "Error: couldn't load data page\n";
+        return false;
+    }
+
+    if (optimistic && (dpage->slot_free(b_rec.offset) || !key_equal(dpage->records[b_rec.offset].key, b_rec.key)))
+    {
+        dpage->pin_count--;
+        return false;
+    }
+    if (dpage->slot_free(b_rec.offset))
+    {
+        dpage->pin_count--;
+        cerr << "Error: slot is marked as free, inconsistent state\n";
+        return false;
+    }
+
+    r = dpage->records[b_rec.offset];
+    dpage->pin_count--;
+    return true;
+}
+
+//walks the B-tree in key order (both ways) keeping the descent path pinned - one page per level
+//(B+-tree: only the current leaf, the cursor follows the links between leaves)
+//the tree mustn't be modified while the cursor is open
+struct B_tree_cursor
+{
+    struct Level
+    {
+        B_tree_page* page;
+        int pos;        //key under the cursor on the last level, child the path goes through on the upper ones
+    };
+
+    vector<Level> path;
+    string index_dat_filename;
+    string data_dat_filename;
+
+    B_tree_cursor(const string& index_filename, const string& data_filename)
+        : index_dat_filename(index_filename), data_dat_filename(data_filename) {}
+
+    ~B_tree_cursor()
+    {
+        close();
+    }
+
+    bool valid()
+    {
+        return !path.empty();
+    }
+
+    void close()
+    {
+        while (!path.empty())
+        {
+            pop();
+        }
+    }
+
+    B_tree_record current()
+    {
+        return path.back().page->record(path.back().pos);
+    }
+
+    //positions on the smallest key >= key, invalid if there is none
+    void seek(unsigned int root, const Key& key)
+    {
+        close();
+        unsigned int page_id = root;
+        while (page_id != UINT_MAX)
+        {
+            if (!push(page_id))
+            {
+                close();
+                return;
+            }
+            B_tree_page* page = path.back().page;
+            bool found;
+            unsigned int i = page->search(key, found);
+            path.back().pos = i;
+            if (page->is_leaf() || (found && !tree_config.bplus_tree))
+            {
+                break;
+            }
+            if (found)
+            {
+                i++;        //B+-tree: keys equal to the separator are on its right
+                path.back().pos = i;
+            }
+            page_id = page->children_id[i];
+        }
+        release_ancestors();
+        skip_finished_forward();
+        prefetch_data_pages();
+    }
+
+    //positions on the biggest key <= key, invalid if there is none
+    void seek_back(unsigned int root, const Key& key)
+    {
+        seek(root, key);
+        if (!valid())
+        {
+            seek_last(root);
+        }
+        else if (key_less(key, current().key))
+        {
+            prev();
+        }
+    }
+
+    void seek_first(unsigned int root)
+    {
+        close();
+        if (root != UINT_MAX && push(root))
+        {
+            path.back().pos = 0;
+            descend(0);
+            release_ancestors();
+            skip_finished_forward();
+            prefetch_data_pages();
+        }
+    }
+
+    void seek_last(unsigned int root)
+    {
+        close();
+        if (root != UINT_MAX && push(root))
+        {
+            path.back().pos = path.back().page->keys_num;
+            descend(UINT_MAX);
+            path.back().pos--;
+            release_ancestors();
+            skip_finished_backward();
+            prefetch_data_pages();
+        }
+    }
+
+    void next()
+    {
+        Level& top = path.back();
+        top.pos++;
+        if (!top.page->is_leaf())
+        {
+            descend(0);       //successor is the leftmost key of the right subtree
+            prefetch_data_pages();
+            return;
+        }
+        if (top.pos < top.page->keys_num)
+        {
+            return;
+        }
+        skip_finished_forward();
+    }
+
+    void prev()
+    {
+        Level& top = path.back();
+        if (!top.page->is_leaf())
+        {
+            descend(UINT_MAX);        //predecessor is the rightmost key of the left subtree
+            path.back().pos--;
+            prefetch_data_pages();
+            return;
+        }
+        top.pos--;
+        skip_finished_backward();
+    }
+
+    //record the current key points to
+    Record record()
+    {
+        Record r;
+        if (!fetch_record(current(), data_dat_filename, r))
+        {
+            return {no_key, {UINT_MAX, UINT_MAX, UINT_MAX, UINT_MAX, UINT_MAX}};
+        }
+        return r;
+    }
+
+    bool push(unsigned int page_id)
+    {
+        B_tree_page* page = get_index_page(page_id, index_dat_filename);
+        if (!page)
+        {
+            return false;
+        }
+        path.push_back({page, 0});
+        return true;
+    }
+
+    void pop()
+    {
+        release_index_page(path.back().page);
+        path.pop_back();
+    }
+
+    //goes down through path.back().pos child to the leaf, taking the leftmost (0) or rightmost (UINT_MAX) child on the way
+    void descend(unsigned int side)
+    {
+        while (!path.back().page->is_leaf())
+        {
+            if (!push(path.back().page->children_id[path.back().pos]))
+            {
+                close();
+                return;
+            }
+            B_tree_page* page = path.back().page;
+            path.back().pos = side == 0 ? 0 : page->keys_num;
+        }
+    }
+
+    //B+-tree cursor moves along the chain of leaves, so only the leaf stays pinned
+    void release_ancestors()
+    {
+        if (!tree_config.bplus_tree || path.empty())
+        {
+            return;
+        }
+        for (unsigned int i = 0; i + 1 < path.size(); i++)
+        {
+            release_index_page(path[i].page);
+        }
+        path.erase(path.begin(), path.end() - 1);
+    }
+
+    //replaces the current leaf with its neighbour, invalid if there is none
+    void step_to_leaf(unsigned int page_id)
+    {
+        pop();
+        if (page_id != UINT_MAX && push(page_id))
+        {
+            prefetch_data_pages();
+        }
+    }
+
+    //after the last key of a page the next one is the parent's key following the child
+    //(B+-tree: the first key of the next leaf)
+    void skip_finished_forward()
+    {
+        while (!path.empty() && path.back().pos >= path.back().page->keys_num)
+        {
+            if (tree_config.bplus_tree)
+            {
+                step_to_leaf(path.back().page->next_leaf);
+                continue;
+            }
+            pop();
+        }
+    }
+
+    //before the first key of a page the previous one is the parent's key preceding the child
+    //(B+-tree: the last key of the previous leaf)
+    void skip_finished_backward()
+    {
+        while (!path.empty() && path.back().pos < 0)
+        {
+            if (tree_config.bplus_tree)
+            {
+                step_to_leaf(path.back().page->prev_leaf);
+                if (!path.empty())
+                {
+                    path.back().pos = path.back().page->keys_num - 1;
+                }
+                continue;
+            }
+            pop();
+            if (!path.empty())
+            {
+                path.back().pos--;
+            }
+        }
+    }
+
+    //loads data pages of the leaf's records into the data buffer before they're read
+    void prefetch_data_pages()
+    {
+        if (tree_config.clustered || path.empty() || !path.back().page->is_leaf())
+        {
+            return;
+        }
+        B_tree_page* leaf = path.back().page;
+        vector<unsigned int> pages;
+        unsigned int limit = min(SCAN_PREFETCH_PAGES, DATA_BUFFER_LIMIT - 1);       //prefetched pages can't push each other out
+        for (int i = 0; i < leaf->keys_num && pages.size() < limit; i++)
+        {
+            unsigned int page_id = leaf->pointers[i].page_id;
+            if (find(pages.begin(), pages.end(), page_id) == pages.end())
+            {
+                pages.push_back(page_id);
+            }
+        }
+        lock_guard<mutex> lock(data_latch);
+        read_ahead_data_pages(pages, data_dat_filename);
+    }
+};
+
+//LATCH CRABBING
+//read_record, insert and update_record can be called from many threads at once: every index page they fetch is latched
+//(shared or exclusive) and a page above is released as soon as the change can't reach it anymore - reads and updates
+//release it once the child is latched, inserts keep pages above the last page safe for insert (it can take a split of its
+//child without being split itself), so a split changes nothing that other operations have latched
+//pages are always latched top-down (and siblings or neighbours of a latched page only while its parent is latched or left
+//to right, new pages as soon as nobody else can reach them), so operations can't wait for each other in a cycle - latches
+//belong to frames of the buffer though, so a deadlock detector sees them taken in every order (see tests/tsan.supp)
+//read_record first tries not to latch (nor pin) anything: it checks versions of the pages instead, so readers don't write
+//to the pages they share (the root above all) - see B_tree::search_optimistic()
+
+enum Optimistic_result
+{
+    OPTIMISTIC_DONE,
+    OPTIMISTIC_RESTART,     //a page was changed while being read
+    OPTIMISTIC_MISS         //a page isn't in the buffer (or the tree is latched exclusively)
+};
+
+enum Latch_mode
+{
+    LATCH_NONE,         //operation has the tree to itself (or the program runs alone), pages aren't latched
+    LATCH_READ,         //shared latches
+    LATCH_UPDATE,       //exclusive latches, released the way reads release them - records change in place
+    LATCH_INSERT        //exclusive latches, pages above the last one safe for insert stay latched
+};
+
+//index pages latched by the operation the thread is in the middle of
+struct Operation_latches
+{
+    bool active = false;
+    bool exclusive = false;
+    vector<B_tree_page*> pages;     //one entry for every fetch of a page not released yet, the page is latched while it has any
+    vector<B_tree_page*> held;      //pages above the current one, kept in case a split reaches them
+    shared_mutex* root_latch = nullptr;     //held until the root is known to stay the root
+    bool root_shared = false;
+};
+
+thread_local Operation_latches operation_latches;
+
+//called by get_index_page() for every fetch of a page - the first one latches the page (with the buffer unlocked,
+//an operation waiting for the latch mustn't stop the others from using the buffer)
+void latch_index_page(B_tree_page* page)
+{
+    if (!operation_latches.active)
+    {
+        return;
+    }
+    vector<B_tree_page*>& pages = operation_latches.pages;
+    if (find(pages.begin(), pages.end(), page) == pages.end())
+    {
+        page->latch.lock(operation_latches.exclusive);
+        if (operation_latches.exclusive)
+        {
+            page->version.begin_change();
+        }
+    }
+    pages.push_back(page);
+}
+
+//ends a fetch of the page: the last one unlatches it and then the page is unpinned, so it's never evicted while latched
+void release_index_page(B_tree_page* page)
+{
+    if (operation_latches.active)
+    {
+        vector<B_tree_page*>& pages = operation_latches.pages;
+        vector<B_tree_page*>::iterator it = find(pages.begin(), pages.end(), page);
+        if (it != pages.end())
+        {
+            pages.erase(it);
+            if (find(pages.begin(), pages.end(), page) == pages.end())
+            {
+                if (operation_latches.exclusive)
+                {
+                    page->version.end_change();
+                }
+                page->latch.unlock(operation_latches.exclusive);
+            }
+        }
+    }
+    page->pin_count--;
+}
+
+//pages above the current one (and the root latch) won't be changed by the operation
+void release_ancestors()
+{
+    for (B_tree_page* page : operation_latches.held)
+    {
+        release_index_page(page);
+    }
+    operation_latches.held.clear();
+    if (operation_latches.root_latch)
+    {
+        if (operation_latches.root_shared)
+        {
+            operation_latches.root_latch->unlock_shared();
+        }
+        else
+        {
+            operation_latches.root_latch->unlock();
+        }
+        operation_latches.root_latch = nullptr;
+    }
+}
+
+//latch of the whole tree - its version changes when it's held exclusively, so optimistic reads (which don't take it)
+//notice operations that change pages without latching them
+struct Tree_latch
+{
+    shared_mutex latch;
+    Version_counter version;
+
+    void lock()
+    {
+        latch.lock();
+        version.begin_change();
+    }
+    void unlock()
+    {
+        version.end_change();
+        latch.unlock();
+    }
+    void lock_shared()
+    {
+        latch.lock_shared();
+    }
+    void unlock_shared()
+    {
+        latch.unlock_shared();
+    }
+};
+
+struct B_tree
+{
+    atomic<unsigned int> root;
+    string index_dat_filename;
+    string data_dat_filename;
+    inline static thread_local B_tree_path path;       //of the page being changed, kept between operations so that its memory is reused
+    inline static thread_local vector<unsigned int> batch_order;      //same for insert_batch()
+    inline static thread_local vector<B_tree_record> batch_group;
+    inline static thread_local vector<Key> optimistic_keys;       //copy of the keys of the page search_optimistic() is in
+    Tree_latch tree_latch;          //point operations (read_record, insert, update_record) hold it shared, the rest exclusively
+    shared_mutex root_latch;        //root is read under it, operations that may change the root hold it exclusively
+
+    bool is_empty()
+    {
+        return root == UINT_MAX;
+    }
+
+    //point operations run concurrently - index pages they fetch are latched until released
+    void begin_operation(Latch_mode mode)
+    {
+        tree_latch.lock_shared();
+        operation_latches.active = true;
+        operation_latches.exclusive = mode != LATCH_READ;
+    }
+
+    void end_operation()
+    {
+        release_ancestors();
+        while (!operation_latches.pages.empty())
+        {
+            cerr << "Error: Index page " << operation_latches.pages.back()->id << " wasn't released by the operation" << endl;
+            release_index_page(operation_latches.pages.back());
+        }
+        operation_latches.active = false;
+        tree_latch.unlock_shared();
+    }
+
+    //returns id of the root, read under root_latch (kept until release_ancestors())
+    unsigned int lock_root(Latch_mode mode)
+    {
+        if (mode != LATCH_NONE)
+        {
+            operation_latches.root_shared = mode == LATCH_READ;
+            if (operation_latches.root_shared)
+            {
+                root_latch.lock_shared();
+            }
+            else
+            {
+                root_latch.lock();
+            }
+            operation_latches.root_latch = &root_latch;
+        }
+        return root;
+    }
+
+    void print()
+    {
+        if(!is_empty())
+        {
+            cout<<"Printing B-tree from "<<index_dat_filename<<" file"<<endl;
+            unsigned int disk_reads_before = read_count_data + read_count_index;
+            unsigned int disk_writes_before = write_count_data + write_count_index;
+            B_tree_page* root_page = get_index_page(root, index_dat_filename);
+            root_page->print(1, 1);
+            release_index_page(root_page);
+            //cout<<"Disk reads performed: "<<read_count_data + read_count_index - disk_reads_before<<endl;
+            //cout<<"Disk writes performed: "<<write_count_data + write_count_index - disk_writes_before<<endl;
+        }
+        else
+        {
+            cout<<"Error: Can't print B-tree: B-tree is empty"<<endl;
+        }
+        cout<<endl;
+    }
+
+    //returned page is pinned - caller has to release it (release_index_page())
+    //path (if given) gets the pages passed on the way, the returned one is the last of them
+    //mode (other than LATCH_NONE) - latch crabbing of an operation begun by begin_operation(), pages above the returned one
+    //that are still latched are released by release_ancestors()
+    pair<B_tree_page*, unsigned int> search_for(const Key& key, B_tree_path* path = nullptr, Latch_mode mode = LATCH_NONE)
+    {
+        unsigned int current_page_id = lock_root(mode);
+        if (path)
+        {
+            path->clear(current_page_id);
+        }
+        if (current_page_id == UINT_MAX)
+        {
+            return {nullptr, UINT_MAX};      //not found
+        }
+
+        unsigned int disk_reads_before = read_count_data + read_count_index;
+        unsigned int disk_writes_before = write_count_data + write_count_index;
+
+        B_tree_page* current_page;
+
+        while(true)
+        {
+            current_page = get_index_page(current_page_id, index_dat_filename);
+            if (mode != LATCH_NONE && (mode != LATCH_INSERT || current_page->safe_for_insert()))
+            {
+                release_ancestors();
+            }
+            if (path)
+            {
+                path->push(current_page_id);
+            }
+
+            bool found;
+            unsigned int child = current_page->search(key, found);
+            if(found && (!tree_config.bplus_tree || current_page->is_leaf()))            //found on current page
+            {
+                return {current_page, child};
+            }
+            if(current_page->is_leaf())
+            {
+                return {current_page, UINT_MAX};      //not found
+            }
+            if(found)
+            {
+                child++;        //B+-tree: keys equal to the separator are on its right
+            }
+            if (path)
+            {
+                path->steps.back().child = child;
+            }
+            current_page_id = current_page->children_id[child];
+            if (mode == LATCH_NONE)
+            {
+                release_index_page(current_page);
+            }
+            else
+            {
+                operation_latches.held.push_back(current_page);     //until the child is latched
+            }
+        }
+
+        //shouldn't ever happen
+        return {nullptr, UINT_MAX};
+    }
+
+    //finds the key without latching nor pinning index pages (read_record) - version of every page is read before the page
+    //and checked after it, the parent's one once more after the child's is read (so the child is still the one the key
+    //is in), the root's by reading root again and the tree's at the end
+    //returns OPTIMISTIC_DONE with found (and record) set, OPTIMISTIC_RESTART if something changed meanwhile,
+    //OPTIMISTIC_MISS if a page has to be read from disk (that's left to search_for())
+    Optimistic_result search_optimistic(const Key& key, B_tree_record& record, bool& found)
+    {
+        unsigned long long tree_version = tree_latch.version.read();
+        if (tree_version & 1)
+        {
+            return OPTIMISTIC_MISS;     //pages are being changed for long, waiting for the latch is better
+        }
+        unsigned int page_id = root;
+        found = false;
+        if (page_id == UINT_MAX)
+        {
+            return tree_latch.version.validate(tree_version) ? OPTIMISTIC_DONE : OPTIMISTIC_RESTART;
+        }
+        unsigned int most_keys = max(tree_config.max_keys, tree_config.max_interior_keys);
+        B_tree_page* parent = nullptr;
+        unsigned long long parent_version = 0;
+
+        while (true)
+        {
+            B_tree_page* page = peek_index_page(page_id);
+            if (!page)
+            {
+                return OPTIMISTIC_MISS;
+            }
+            unsigned long long version = page->version.read();
+            if ((version & 1) || load_relaxed(page->id) != page_id)
+            {
+                return OPTIMISTIC_RESTART;
+            }
+            if (parent ? !parent->version.validate(parent_version) : root != page_id)
+            {
+                return OPTIMISTIC_RESTART;
+            }
+
+            //a latched writer may be changing the page meanwhile, so every field is copied with a relaxed load and may be
+            //torn from the rest - keys_num from the keys, a key from its neighbours, a child or pointer from its key (a frame
+            //given another page gets all of them changed). Writers keep the version odd, so validate() after the copies
+            //throws away whatever mixes two states - until then nothing read is used as an index unchecked
+            unsigned int keys_num = load_relaxed(page->keys_num);
+            if (keys_num > most_keys)
+            {
+                return OPTIMISTIC_RESTART;
+            }
+            optimistic_keys.resize(most_keys);
+            for (unsigned int i = 0; i < keys_num; i++)
+            {
+                optimistic_keys[i] = load_relaxed(page->keys[i]);
+            }
+            bool leaf = load_relaxed(page->children_id[0]) == UINT_MAX;
+            unsigned int child = lower_bound_key(optimistic_keys.data(), keys_num, key, Key_compare());
+            bool found_here = child < keys_num && !key_less(key, optimistic_keys[child]);
+            if (leaf || (found_here && !tree_config.bplus_tree))
+            {
+                if (found_here)
+                {
+                    record = {optimistic_keys[child], load_relaxed(page->pointers[child].page_id), load_relaxed(page->pointers[child].offset)};
+                    for (unsigned int i = 0; i < 5 && !page->sides.empty(); i++)
+                    {
+                        record.sides[i] = load_relaxed(page->sides[child * 5 + i]);
+                    }
+                }
+                found = found_here;
+                if (!page->version.validate(version) || !tree_latch.version.validate(tree_version))
+                {
+                    return OPTIMISTIC_RESTART;
+                }
+                return OPTIMISTIC_DONE;
+            }
+            if (found_here)
+            {
+                child++;        //B+-tree: keys equal to the separator are on its right
+            }
+            page_id = load_relaxed(page->children_id[child]);
+            parent = page;
+            parent_version = version;
+        }
+    }
+
+    void insert(B_tree_record new_B_rec)
+    {
+        cout<<"\n\nInserting record with key "<<new_B_rec.key<<endl;
+        
+        unsigned int disk_reads_before = read_count_data + read_count_index;
+        unsigned int disk_writes_before = write_count_data + write_count_index;
+
+        begin_operation(LATCH_INSERT);
+        if(is_empty() && lock_root(LATCH_INSERT) == UINT_MAX)      //checked again under the root latch
+        {
+            B_tree_page* root_page = new_index_page();
+            if(!root_page)
+            {
+                end_operation();
+                release_placed_record(new_B_rec);
+                return;
+            }
+            root = root_page->id;
+            release_index_page(root_page);
+        }
+        release_ancestors();
+
+        pair<B_tree_page*, unsigned int> result = search_for(new_B_rec.key, &path, LATCH_INSERT);
+        B_tree_page* current_page = result.first;
+        unsigned int pos = result.second;
+        unsigned int searched_root = path.root;     //other inserts could have split the root since
+
+        if (pos != UINT_MAX)
+        {
+            release_index_page(current_page);
+            end_operation();
+            release_placed_record(new_B_rec);       //nothing points at its slot in data.dat
+            cout<<"Error: Couldn't insert record. Record with key "<<new_B_rec.key<<" already exists in the B-tree."<<endl;
+            cout<<"Disk reads performed: "<<read_count_data + read_count_index - disk_reads_before<<endl;
+            cout<<"Disk writes performed: "<<write_count_data + write_count_index - disk_writes_before<<endl;
+            return;
+        }
+
+        current_page->insert(new_B_rec, path, path.steps.size()-1);
+        release_index_page(current_page);
+        if(path.root != searched_root)
+        {
+            root = path.root;       //the root was split - its latch is still held
+        }
+        end_operation();
+
+        cout<<"Disk reads performed: "<<read_count_data + read_count_index - disk_reads_before<<endl;
+        cout<<"Disk writes performed: "<<write_count_data + write_count_index - disk_writes_before<<endl;
+        cout<<endl;
+
+        if(PRINT_FILES)
+        {
+            print_data_dat(data_dat_filename);
+            print();
+        }
+    }
+
+    //streams records with lo <= key <= hi to visit in ascending (or descending) key order, returns their number
+    unsigned int scan(const Key& lo, const Key& hi, const function<void(const Record&)>& visit, bool descending = false)
+    {
+        cout<<"\n\nScanning records with keys from "<<lo<<" to "<<hi<<endl;
+
+        unsigned int disk_reads_before = read_count_data + read_count_index;
+        unsigned int disk_writes_before = write_count_data + write_count_index;
+
+        unique_lock<Tree_latch> exclusive(tree_latch);      //the cursor mustn't see the tree changing
+        unsigned int count = 0;
+        B_tree_cursor cursor(index_dat_filename, data_dat_filename);
+        if (!descending)
+        {
+            for (cursor.seek(root, lo); cursor.valid() && !key_less(hi, cursor.current().key); cursor.next())
+            {
+                visit(cursor.record());
+                count++;
+            }
+        }
+        else
+        {
+            for (cursor.seek_back(root, hi); cursor.valid() && !key_less(cursor.current().key, lo); cursor.prev())
+            {
+                visit(cursor.record());
+                count++;
+            }
+        }
+        cursor.close();
+        exclusive.unlock();
+
+        cout<<"Records found: "<<count<<endl;
+        cout<<"Disk reads performed: "<<read_count_data + read_count_index - disk_reads_before<<endl;
+        cout<<"Disk writes performed: "<<write_count_data + write_count_index - disk_writes_before<<endl;
+        cout<<endl;
+        return count;
+    }
+
+    //inserts many records at once: they're sorted by key, every leaf is reached with a single descent
+    //and gets all of its new keys together, so it's split (into as many pages as needed) at most once
+    void insert_batch(const vector<Record>& records)
+    {
+        cout<<"\n\nInserting batch of "<<records.size()<<" records"<<endl;
+
+        unsigned int disk_reads_before = read_count_data + read_count_index;
+        unsigned int disk_writes_before = write_count_data + write_count_index;
+
+        //positions of the records sorted by key, the first one of equal keys is inserted
+        batch_order.resize(records.size());
+        for(unsigned int i = 0; i < batch_order.size(); i++)
+        {
+            batch_order[i] = i;
+        }
+        sort(batch_order.begin(), batch_order.end(), [&records](unsigned int a, unsigned int b)
+        {
+            return key_less(records[a].key, records[b].key) || (!key_less(records[b].key, records[a].key) && a < b);
+        });
+        unique_lock<Tree_latch> exclusive(tree_latch);      //leaves are split into many pages at once
+
+        if(is_empty() && !records.empty())
+        {
+            B_tree_page* root_page = new_index_page();
+            if(!root_page)
+            {
+                return;
+            }
+            root = root_page->id;
+            release_index_page(root_page);
+        }
+
+        unsigned int inserted = 0;
+        unsigned int n = 0;
+        while(n < records.size())
+        {
+            //going down to the leaf of the smallest key left, keys from the smallest separator on the right up belong to other leaves
+            Key key = records[batch_order[n]].key;
+            Key bound = no_key;
+            bool bounded = false;
+            path.clear(root);
+            path.push(root);
+            B_tree_page* page = get_index_page(root, index_dat_filename);
+            while(!page->is_leaf())
+            {
+                bool found;
+                unsigned int i = page->search(key, found);
+                if(found)
+                {
+                    if(!tree_config.bplus_tree)
+                    {
+                        break;      //already in the tree
+                    }
+                    i++;        //B+-tree: keys equal to the separator are on its right
+                }
+                if(i < page->keys_num)
+                {
+                    bound = page->keys[i];
+                    bounded = true;
+                }
+                unsigned int child_id = page->children_id[i];
+                path.steps.back().child = i;
+                path.push(child_id);
+                release_index_page(page);
+                page = get_index_page(child_id, index_dat_filename);
+            }
+
+            if(!page->is_leaf())
+            {
+                release_index_page(page);
+                cout<<"Error: Couldn't insert record. Record with key "<<key<<" already exists in the B-tree."<<endl;
+                n++;
+                continue;
+            }
+
+            vector<B_tree_record>& group = batch_group;
+            group.clear();
+            for(; n < records.size() && (!bounded || key_less(records[batch_order[n]].key, bound)); n++)
+            {
+                const Record& r = records[batch_order[n]];
+                bool found;
+                page->search(r.key, found);
+                if((n > 0 && key_equal(records[batch_order[n-1]].key, r.key)) || found)
+                {
+                    cout<<"Error: Couldn't insert record. Record with key "<<r.key<<" already exists in the B-tree."<<endl;
+                    continue;
+                }
+                group.push_back(place_record(r));
+            }
+            if(!group.empty())
+            {
+                page->insert_many(group, path, path.steps.size()-1);
+                inserted += group.size();
+            }
+            release_index_page(page);
+            root = path.root;       //splits could have added levels
+        }
+        exclusive.unlock();
+
+        cout<<"Records inserted: "<<inserted<<endl;
+        cout<<"Disk reads performed: "<<read_count_data + read_count_index - disk_reads_before<<endl;
+        cout<<"Disk writes performed: "<<write_count_data + write_count_index - disk_writes_before<<endl;
+        cout<<endl;
+
+        if(PRINT_FILES)
+        {
+            print_data_dat(data_dat_filename);
+            print();
+        }
+    }
+
+    //goes down from the last page of path (pinned page) through its child number child and then always through
+    //the first (or the last) child, returns the pinned leaf - path gets the pages passed
+    B_tree_page* descend_to_leaf(B_tree_path& path, B_tree_page* page, unsigned int child, bool rightmost)
+    {
+        path.steps.back().child = child;
+        unsigned int page_id = page->children_id[child];
+        while(true)
+        {
+            B_tree_page* current_page = get_index_page(page_id, index_dat_filename);
+            path.push(page_id);
+            if(current_page->is_leaf())
+            {
+                return current_page;
+            }
+            path.steps.back().child = rightmost ? current_page->keys_num : 0;
+            page_id = current_page->children_id[path.steps.back().child];
+            release_index_page(current_page);
+        }
+    }
+
+    Record read_record(const Key& key)
+    {
+        cout<<"\n\nReading record with key "<<key<<endl;
+        
+        unsigned int disk_reads_before = read_count_data + read_count_index;
+        unsigned int disk_writes_before = write_count_data + write_count_index;
+
+        B_tree_record b_rec;
+        bool found = false;
+        Optimistic_result optimistic = OPTIMISTIC_MISS;
+        if (is_trivially_copyable<Key>::value)      //a string key read while it's being changed could point anywhere
+        {
+            for (unsigned int attempt = 0; attempt < OPTIMISTIC_READ_RETRIES; attempt++)
+            {
+                optimistic = search_optimistic(key, b_rec, found);
+                if (optimistic != OPTIMISTIC_RESTART)
+                {
+                    break;
+                }
+            }
+        }
+        Record r;
+        bool fetched = false;
+        if (optimistic == OPTIMISTIC_DONE && found)
+        {
+            fetched = fetch_record(b_rec, data_dat_filename, r, true);
+        }
+        if (optimistic != OPTIMISTIC_DONE || (found && !fetched))
+        {
+            begin_operation(LATCH_READ);
+            pair<B_tree_page*, unsigned int> result = search_for(key, nullptr, LATCH_READ);
+            B_tree_page* current_page = result.first;
+            found = result.second != UINT_MAX;
+            if (found)
+            {
+                b_rec = current_page->record(result.second);
+            }
+            if (current_page)
+            {
+                release_index_page(current_page);
+            }
+            if (found)      //removals wait for the tree latch, so until end_operation() the slot holds this record
+            {
+                fetched = fetch_record(b_rec, data_dat_filename, r);
+            }
+            end_operation();
+        }
+
+        if(!found)
+        {
+            cout<<"Error: Couldn't read record. Key "<<key<<" does not exist in the B-tree."<<endl;
+            cout<<"Disk reads performed: "<<read_count_data + read_count_index - disk_reads_before<<endl;
+            cout<<"Disk writes performed: "<<write_count_data + write_count_index - disk_writes_before<<endl;
+            return {no_key, {UINT_MAX, UINT_MAX, UINT_MAX, UINT_MAX, UINT_MAX}};
+        }
+        if (!fetched)
+        {
+            return {no_key, {UINT_MAX, UINT_MAX, UINT_MAX, UINT_MAX, UINT_MAX}};
+        }
+
+        cout << "Loaded record key = " << r.key << endl;
+        for (int i = 0; i < 5; i++)
+        {
+            cout << r.sides[i] << " ";
+        }
+        cout << endl;
+
+        cout<<"Disk reads performed: "<<read_count_data + read_count_index - disk_reads_before<<endl;
+        cout<<"Disk writes performed: "<<write_count_data + write_count_index - disk_writes_before<<endl;
+        cout<<endl;
+
+        return {r.key, {r.sides[0], r.sides[1], r.sides[2], r.sides[3], r.sides[4]}};
+    }
+
+    //reads ahead the pages a batch of read_record() calls will need: the keys go down the tree together, pages of a level
+    //that aren't in the buffer are read at once (as many as half of the buffer takes), then data pages of the records found
+    //nothing is latched while the pages are read, other operations go on - pages of a level are then looked at like
+    //read_record() does (they can have changed since, read_record() finds its records anyway)
+    void read_ahead(const vector<Key>& keys)
+    {
+        cout<<"\n\nReading ahead pages of "<<keys.size()<<" reads"<<endl;
+
+        unsigned int disk_reads_before = read_count_data + read_count_index;
+        unsigned int disk_writes_before = write_count_data + write_count_index;
+
+        vector<unsigned int> current(keys.size(), root);       //page each key has got to, UINT_MAX when it's done
+        vector<unsigned int> data_pages;
+        unsigned int limit = max(1, INDEX_BUFFER_LIMIT / 2);
+        while (true)
+        {
+            vector<unsigned int> level;
+            for (unsigned int page_id : current)
+            {
+                if (page_id != UINT_MAX && level.size() < limit && find(level.begin(), level.end(), page_id) == level.end())
+                {
+                    level.push_back(page_id);
+                }
+            }
+            if (level.empty())
+            {
+                break;
+            }
+            read_ahead_index_pages(level, index_dat_filename);
+
+            begin_operation(LATCH_READ);
+            for (unsigned int i = 0; i < keys.size(); i++)
+            {
+                if (current[i] == UINT_MAX)
+                {
+                    continue;
+                }
+                B_tree_page* page = find_index_page(current[i]);
+                current[i] = UINT_MAX;
+                if (!page)
+                {
+                    continue;       //didn't fit - read_record() reads it
+                }
+                bool found;
+                unsigned int child = page->search(keys[i], found);
+                if (found && (!tree_config.bplus_tree || page->is_leaf()))
+                {
+                    if (!tree_config.clustered && find(data_pages.begin(), data_pages.end(), page->pointers[child].page_id) == data_pages.end())
+                    {
+                        data_pages.push_back(page->pointers[child].page_id);
+                    }
+                }
+                else if (!page->is_leaf())
+                {
+                    current[i] = page->children_id[found ? child + 1 : child];
+                }
+                release_index_page(page);
+            }
+            end_operation();
+        }
+
+        data_pages.resize(min((size_t)DATA_BUFFER_LIMIT - 1, data_pages.size()));     //pages read ahead can't push each other out
+        {
+            lock_guard<mutex> lock(data_latch);
+            read_ahead_data_pages(data_pages, data_dat_filename);
+        }
+
+        cout<<"Disk reads performed: "<<read_count_data + read_count_index - disk_reads_before<<endl;
+        cout<<"Disk writes performed: "<<write_count_data + write_count_index - disk_writes_before<<endl;
+    }
+
+    void update_record(Record rec)
+    {
+        cout<<"\n\nUpdating record with key "<<rec.key<<" to ";
+        for(int i = 0; i<5; i++)
+        {
+            cout<<rec.sides[i]<<" ";
+        }
+        cout<<endl;
+
+        unsigned int disk_reads_before = read_count_data + read_count_index;
+        unsigned int disk_writes_before = write_count_data + write_count_index;
+
+        begin_operation(LATCH_UPDATE);
+        pair<B_tree_page*, unsigned int> result = search_for(rec.key, nullptr, LATCH_UPDATE);
+        B_tree_page* page = result.first;
+        unsigned int pos = result.second;
+
+        if(pos == UINT_MAX)     //not in the tree
+        {
+            if(page)
+            {
+                release_index_page(page);
+            }
+            end_operation();
+            cout<<"Error: Couldn't update record. Record with key "<<rec.key<<" does not exist in the B-tree."<<endl;
+            cout<<"Disk reads performed: "<<read_count_data + read_count_index - disk_reads_before<<endl;
+            cout<<"Disk writes performed: "<<write_count_data + write_count_index - disk_writes_before<<endl;
+            return;
+        }
+
+        if(tree_config.clustered)
+        {
+            if(sides_valid(rec))
+            {
+                copy_n(rec.sides, 5, &page->sides[pos * 5]);
+                page->dirty = true;
+            }
+            release_index_page(page);
+            end_operation();
+        }
+        else
+        {
+            B_tree_record rec_to_change = page->record(pos);
+            release_index_page(page);
+            update_rec_in_data_dat(rec_to_change, rec);       //before end_operation() - a removal could free the slot
+            end_operation();
+        }
+
+
+        cout<<"Disk reads performed: "<<read_count_data + read_count_index - disk_reads_before<<endl;
+        cout<<"Disk writes performed: "<<write_count_data + write_count_index - disk_writes_before<<endl;
+        cout<<endl;
+
+        if(PRINT_FILES)
+        {
+            print_data_dat(data_dat_filename);
+            print();
+        }
+    
+    }
+
+    void remove(const Key& key)
+    {
+        cout<<"\n\nRemoving record with key "<<key<<endl;
+        
+        unsigned int disk_reads_before = read_count_data + read_count_index;
+        unsigned int disk_writes_before = write_count_data + write_count_index;
+
+        //merges go up through the siblings and down from the page of the key to a leaf - the tree is taken exclusively
+        unique_lock<Tree_latch> exclusive(tree_latch);
+        pair<B_tree_page*, unsigned int> result = search_for(key, &path);
+        B_tree_page* page = result.first;
+        unsigned int pos = result.second;
+
+        if(pos == UINT_MAX)
+        {
+            if(page)
+            {
+                release_index_page(page);
+            }
+            cout<<"Error: Couldn't remove record. Record with key "<<key<<" does not exist in the B-tree."<<endl;
+            cout<<"Disk reads performed: "<<read_count_data + read_count_index - disk_reads_before<<endl;
+            cout<<"Disk writes performed: "<<write_count_data + write_count_index - disk_writes_before<<endl;
+            return;
+        }
+
+        B_tree_record rec = page->record(pos);
+        B_tree_page* page_to_check;
+        if(!tree_config.clustered)
+        {
+            remove_rec_from_data_dat(rec);
+        }
+
+        if(!page->is_leaf())
+        {
+            B_tree_path left_path = path;
+            B_tree_path right_path = path;
+            B_tree_page* child = descend_to_leaf(left_path, page, pos, true);      //left child, going to the right side until we reach the leaf
+            bool from_left = true;
+
+            if(child->keys_num == child->min_keys())
+            {
+                B_tree_page* predeccesor_page = child;      //remembering predeccesor's position in case exchanging with successor also will result in merge
+                //to prevent underflow nad merging, we're taking from the right side
+                child = descend_to_leaf(right_path, page, pos + 1, false);      //right child, going to the left side until we reach the leaf
+                if(child->keys_num == child->min_keys())
+                {
+                    release_index_page(child);
+                    child = predeccesor_page;       //taking from the left side is prefered
+                }
+                else
+                {
+                    from_left = false;
+                    release_index_page(predeccesor_page);
+                }
+            }
+            path = from_left ? left_path : right_path;
+            if(from_left)
+            {
+                page->set_record(pos, child->record(child->keys_num-1));        //taking the maximum value
+                child->clear_record(child->keys_num-1);     //clearing spot
+            }
+            else
+            {
+                page->set_record(pos, child->record(0));       //taking the minimum value
+                for(int i = 0; i<child->keys_num-1; i++)
+                {
+                    child->set_record(i, child->record(i+1));
                 }
+                child->clear_record(child->keys_num-1);
+            }
+            child->keys_num--;
+            child->dirty = true;
+            page->dirty = true;
+            page_to_check = child;
+        }
+        else
+        {
+            for(int j = pos; j <page->keys_num-1; j++)
+            {
+                page->set_record(j, page->record(j+1));
+            }
+            page->clear_record(page->keys_num - 1);
+            page->keys_num--;
+            page->dirty = true;
+            page_to_check = page;
+        }
+
+        bool tree_emptied = false;
+        unsigned int level = path.steps.size()-1;       //of page_to_check
+        if(level == 0)
+        {
+            tree_emptied = page_to_check->keys_num == 0 && page_to_check->is_leaf();      //last record removed
+        }
+        else if(page_to_check->is_underflown(false))
+        {
+            unsigned int sibling_id = page_to_check->compensation_possible(path, level);
+            if(sibling_id != UINT_MAX)
+            {
+                page_to_check->compensate(sibling_id, path, level);
+            }
+            else
+            {
+                page_to_check->merge(index_dat_filename, path, level);
+            }
+        }
+
+        if(page_to_check != page)
+        {
+            release_index_page(page);
+        }
+        release_index_page(page_to_check);
+
+        if(tree_emptied)
+        {
+            free_index_page(root);
+            root = UINT_MAX;
+        }
+        else
+        {
+            root = path.root;
+        }
+
+        cout<<"Disk reads performed: "<<read_count_data + read_count_index - disk_reads_before<<endl;
+        cout<<"Disk writes performed: "<<write_count_data + write_count_index - disk_writes_before<<endl;
+        cout<<endl;
+
+        exclusive.unlock();
+        if(PRINT_FILES)
+        {
+            print_data_dat(data_dat_filename);
+            print();
+        }
+    }
+};
+
+
+//REPLACEMENT POLICIES
+
+
+enum Policy_type
+{
+    POLICY_LRU,
+    POLICY_CLOCK,
+    POLICY_LRU_K
+};
+
+//decides which frame of a page buffer is evicted; frames are identified by their index in the buffer
+struct Replacement_policy
+{
+    unsigned long long hits = 0;
+    unsigned long long misses = 0;
+
+    virtual ~Replacement_policy() = default;
+    virtual const char* name() = 0;
+    virtual void page_loaded(unsigned int frame) = 0;       //new page was put into the frame
+    virtual void page_accessed(unsigned int frame) = 0;     //page already in the frame was used again
+    virtual void page_removed(unsigned int frame) = 0;      //frame became empty
+    //returns frame to evict, UINT_MAX if none of the frames can be evicted
+    virtual unsigned int pick_victim(const function<bool(unsigned int)>& evictable) = 0;
+};
+
+//least recently used - frames kept in a list, most recently used at the head
+struct Lru_policy : Replacement_policy
+{
+    vector<unsigned int> prev;
+    vector<unsigned int> next;
+    vector<bool> in_list;
+    unsigned int head = UINT_MAX;
+    unsigned int tail = UINT_MAX;
+
+    Lru_policy(unsigned int frames) : prev(frames, UINT_MAX), next(frames, UINT_MAX), in_list(frames, false) {}
+
+    const char* name()
+    {
+        return "LRU";
+    }
+    void unlink(unsigned int frame)
+    {
+        if (!in_list[frame])
+        {
+            return;
+        }
+        if (prev[frame] != UINT_MAX)
+        {
+            next[prev[frame]] = next[frame];
+        }
+        else
+        {
+            head = next[frame];
+        }
+        if (next[frame] != UINT_MAX)
+        {
+            prev[next[frame]] = prev[frame];
+        }
+        else
+        {
+            tail = prev[frame];
+        }
+        prev[frame] = UINT_MAX;
+        next[frame] = UINT_MAX;
+        in_list[frame] = false;
+    }
+    void push_front(unsigned int frame)
+    {
+        next[frame] = head;
+        prev[frame] = UINT_MAX;
+        if (head != UINT_MAX)
+        {
+            prev[head] = frame;
+        }
+        head = frame;
+        if (tail == UINT_MAX)
+        {
+            tail = frame;
+        }
+        in_list[frame] = true;
+    }
+    void page_loaded(unsigned int frame)
+    {
+        unlink(frame);
+        push_front(frame);
+    }
+    void page_accessed(unsigned int frame)
+    {
+        unlink(frame);
+        push_front(frame);
+    }
+    void page_removed(unsigned int frame)
+    {
+        unlink(frame);
+    }
+    unsigned int pick_victim(const function<bool(unsigned int)>& evictable)
+    {
+        for (unsigned int frame = tail; frame != UINT_MAX; frame = prev[frame])
+        {
+            if (evictable(frame))
+            {
+                return frame;
+            }
+        }
+        return UINT_MAX;
+    }
+};
+
+//second chance - the hand skips (and clears) frames referenced since its last pass
+struct Clock_policy : Replacement_policy
+{
+    vector<bool> referenced;
+    vector<bool> used;
+    unsigned int hand = 0;
+
+    Clock_policy(unsigned int frames) : referenced(frames, false), used(frames, false) {}
+
+    const char* name()
+    {
+        return "CLOCK";
+    }
+    void page_loaded(unsigned int frame)
+    {
+        used[frame] = true;
+        referenced[frame] = true;
+    }
+    void page_accessed(unsigned int frame)
+    {
+        referenced[frame] = true;
+    }
+    void page_removed(unsigned int frame)
+    {
+        used[frame] = false;
+        referenced[frame] = false;
+    }
+    unsigned int pick_victim(const function<bool(unsigned int)>& evictable)
+    {
+        unsigned int frames = used.size();
+        for (unsigned int step = 0; step < 2 * frames; step++)     //after one full pass all reference bits are cleared
+        {
+            unsigned int frame = hand;
+            hand = (hand + 1) % frames;
+            if (!used[frame] || !evictable(frame))
+            {
+                continue;
+            }
+            if (referenced[frame])
+            {
+                referenced[frame] = false;
+                continue;
+            }
+            return frame;
+        }
+        return UINT_MAX;
+    }
+};
+
+//LRU-K - evicts the page whose k-th most recent access is the oldest,
+//pages with less than k accesses go first (the one used least recently)
+struct Lru_k_policy : Replacement_policy
+{
+    unsigned int k;
+    unsigned long long now = 0;
+    vector<unsigned long long> history;     //k last access times of each frame, most recent first
+    vector<unsigned int> history_len;
+
+    Lru_k_policy(unsigned int frames, unsigned int k_value) : k(k_value), history(frames * k_value, 0), history_len(frames, 0) {}
+
+    const char* name()
+    {
+        return "LRU-K";
+    }
+    void add_access(unsigned int frame)
+    {
+        unsigned long long* h = &history[frame * k];
+        for (unsigned int i = k - 1; i > 0; i--)
+        {
+            h[i] = h[i - 1];
+        }
+        h[0] = ++now;
+        if (history_len[frame] < k)
+        {
+            history_len[frame]++;
+        }
+    }
+    void page_loaded(unsigned int frame)
+    {
+        history_len[frame] = 0;
+        add_access(frame);
+    }
+    void page_accessed(unsigned int frame)
+    {
+        add_access(frame);
+    }
+    void page_removed(unsigned int frame)
+    {
+        history_len[frame] = 0;
+    }
+    unsigned int pick_victim(const function<bool(unsigned int)>& evictable)
+    {
+        unsigned int victim = UINT_MAX;
+        bool victim_has_k = true;
+        unsigned long long victim_time = ULLONG_MAX;
+        for (unsigned int frame = 0; frame < history_len.size(); frame++)
+        {
+            if (history_len[frame] == 0 || !evictable(frame))
+            {
+                continue;
+            }
+            bool has_k = history_len[frame] == k;
+            //without k accesses the backward k-distance is infinite - last accesses are compared instead
+            unsigned long long time = has_k ? history[frame * k + k - 1] : history[frame * k];
+            if ((victim_has_k && !has_k) || (victim_has_k == has_k && time < victim_time))
+            {
+                victim = frame;
+                victim_has_k = has_k;
+                victim_time = time;
+            }
+        }
+        return victim;
+    }
+};
+
+Replacement_policy* make_replacement_policy(Policy_type type, unsigned int frames)
+{
+    switch (type)
+    {
+        case POLICY_CLOCK:
+            return new Clock_policy(frames);
+        case POLICY_LRU_K:
+            return new Lru_k_policy(frames, LRU_K_VALUE);
+        default:
+            return new Lru_policy(frames);
+    }
+}
+
+
+//PAGE BUFFERS
+
+
+//page id -> frame, open addressing with linear probing in a table allocated once (twice as many slots as frames),
+//so loading and evicting pages doesn't allocate memory
+//changed under the buffer latch, slots are atomic so that optimistic reads can look pages up without it
+struct Page_table
+{
+    vector<atomic<unsigned int>> slot_page;     //UINT_MAX if the slot is empty
+    vector<atomic<unsigned int>> slot_frame;
+    unsigned int mask;
+    unsigned int count = 0;
+
+    Page_table(unsigned int frames)
+    {
+        unsigned int slots = 2;
+        while (slots < 2 * frames)
+        {
+            slots *= 2;
+        }
+        slot_page = vector<atomic<unsigned int>>(slots);
+        slot_frame = vector<atomic<unsigned int>>(slots);
+        for (unsigned int slot = 0; slot < slots; slot++)
+        {
+            slot_page[slot] = UINT_MAX;
+            slot_frame[slot] = UINT_MAX;
+        }
+        mask = slots - 1;
+    }
+
+    unsigned int home_slot(unsigned int page_id)
+    {
+        return (page_id * 2654435761u) & mask;
+    }
+
+    //returns slot of the page, UINT_MAX if it's not in the table
+    unsigned int find_slot(unsigned int page_id)
+    {
+        for (unsigned int slot = home_slot(page_id); slot_page[slot] != UINT_MAX; slot = (slot + 1) & mask)
+        {
+            if (slot_page[slot] == page_id)
+            {
+                return slot;
+            }
+        }
+        return UINT_MAX;
+    }
+
+    //returns frame of the page, UINT_MAX if it's not in the table
+    unsigned int find(unsigned int page_id)
+    {
+        unsigned int slot = find_slot(page_id);
+        return slot == UINT_MAX ? UINT_MAX : slot_frame[slot].load();
+    }
+
+    //lookup without the buffer latch - entries moved meanwhile can be missed and the frame found can be just getting
+    //another page, so the caller checks the page in it
+    unsigned int find_unlatched(unsigned int page_id)
+    {
+        unsigned int slot = home_slot(page_id);
+        for (unsigned int probes = 0; probes <= mask; probes++)
+        {
+            unsigned int slot_page_id = slot_page[slot];
+            if (slot_page_id == UINT_MAX)
+            {
+                break;
+            }
+            if (slot_page_id == page_id)
+            {
+                return slot_frame[slot];
+            }
+            slot = (slot + 1) & mask;
+        }
+        return UINT_MAX;
+    }
+
+    void insert(unsigned int page_id, unsigned int frame)
+    {
+        unsigned int slot = home_slot(page_id);
+        while (slot_page[slot] != UINT_MAX && slot_page[slot] != page_id)
+        {
+            slot = (slot + 1) & mask;
+        }
+        if (slot_page[slot] == UINT_MAX)
+        {
+            count++;
+        }
+        slot_page[slot] = page_id;
+        slot_frame[slot] = frame;
+    }
+
+    void erase(unsigned int page_id)
+    {
+        unsigned int slot = find_slot(page_id);
+        if (slot == UINT_MAX)
+        {
+            return;
+        }
+        count--;
+        //entries after the removed one are moved back, so that no probe sequence is broken by the empty slot
+        unsigned int next = slot;
+        while (true)
+        {
+            next = (next + 1) & mask;
+            if (slot_page[next] == UINT_MAX)
+            {
+                break;
+            }
+            unsigned int home = home_slot(slot_page[next]);
+            if (((next - home) & mask) >= ((next - slot) & mask))
+            {
+                slot_page[slot] = slot_page[next].load();
+                slot_frame[slot] = slot_frame[next].load();
+                slot = next;
+            }
+        }
+        slot_page[slot] = UINT_MAX;
+        slot_frame[slot] = UINT_MAX;
+    }
+};
+
+//part of a page buffer - pages whose ids fall into it, with their own latch, page table and replacement policy
+//fixed number of frames allocated once, so pointers to buffered pages stay valid until eviction
+//pages with pin_count > 0 are never evicted
+template <typename Page>
+struct Buffer_shard
+{
+    mutex latch;        //concurrent operations find, add and remove index pages of the shard one at a time (data pages are used under data_latch)
+    vector<unique_ptr<Page>> frames;
+    vector<unsigned int> frame_page_id;     //UINT_MAX if the frame is empty
+    vector<unsigned int> free_frames;
+    Page_table page_table;
+    unique_ptr<Replacement_policy> policy;
+    void (*write_back)(unsigned int, Page&, const string&);     //used to save dirty victims
+    vector<pair<unsigned int, unsigned long long>> reading;     //pages being read ahead without the latch, with the tickets of the reads
+    unsigned long long next_ticket = 0;
+
+    Buffer_shard(unsigned int limit, Policy_type type, void (*write_back_function)(unsigned int, Page&, const string&))
+        : page_table(limit)
+    {
+        policy.reset(make_replacement_policy(type, limit));
+        write_back = write_back_function;
+        for (unsigned int i = 0; i < limit; i++)
+        {
+            frames.push_back(make_unique<Page>());
+            frame_page_id.push_back(UINT_MAX);
+            free_frames.push_back(limit - 1 - i);
+        }
+    }
+
+    unsigned int size()
+    {
+        return page_table.count;
+    }
+
+    //returns pinned page if it's in RAM, nullptr otherwise
+    Page* find(unsigned int page_id)
+    {
+        unsigned int frame = page_table.find(page_id);
+        if (frame == UINT_MAX)
+        {
+            policy->misses++;
+            return nullptr;
+        }
+        policy->hits++;
+        policy->page_accessed(frame);
+        Page* page = frames[frame].get();
+        page->pin_count++;
+        return page;
+    }
+
+    //returns the page if it's in RAM without pinning it nor taking the buffer latch (optimistic reads), nullptr otherwise
+    //the frame can be getting another page meanwhile - the caller checks the page's id and version
+    //such reads aren't counted as hits and don't change the order of eviction
+    Page* peek(unsigned int page_id)
+    {
+        unsigned int frame = page_table.find_unlatched(page_id);
+        if (frame >= frames.size())
+        {
+            return nullptr;
+        }
+        return frames[frame].get();
+    }
+
+    //returns frame assigned to the page (to be filled by the caller), evicting another page if needed
+    //nullptr if all the pages are pinned
+    Page* add(unsigned int page_id, const string& filename)
+    {
+        unsigned int frame;
+        if (!free_frames.empty())
+        {
+            frame = free_frames.back();
+            free_frames.pop_back();
+        }
+        else
+        {
+            frame = policy->pick_victim([this](unsigned int f) { return frames[f]->pin_count == 0; });
+            if (frame == UINT_MAX)
+            {
+                return nullptr;
+            }
+            Page* victim = frames[frame].get();
+            if (victim->dirty)
+            {
+                write_back(frame_page_id[frame], *victim, filename);
+                victim->dirty = false;
+            }
+            page_table.erase(frame_page_id[frame]);
+            policy->page_removed(frame);
+        }
+        if (!reading.empty())       //images of the page being read can be older than this page will be
+        {
+            reading.erase(remove_if(reading.begin(), reading.end(), [page_id](const pair<unsigned int, unsigned long long>& r)
+            {
+                return r.first == page_id;
+            }), reading.end());
+        }
+        frame_page_id[frame] = page_id;
+        page_table.insert(page_id, frame);
+        policy->page_loaded(frame);
+        return frames[frame].get();
+    }
+
+    //read-ahead: the image of the page read without the latch is the newest one unless the page is added meanwhile
+    unsigned long long start_reading(unsigned int page_id)
+    {
+        reading.push_back({page_id, next_ticket});
+        return next_ticket++;
+    }
+    //false if the page was added since start_reading()
+    bool end_reading(unsigned int page_id, unsigned long long ticket)
+    {
+        vector<pair<unsigned int, unsigned long long>>::iterator it = std::find(reading.begin(), reading.end(), make_pair(page_id, ticket));
+        if (it == reading.end())
+        {
+            return false;
+        }
+        reading.erase(it);
+        return true;
+    }
+
+    //drops the page without saving it
+    void remove(unsigned int page_id)
+    {
+        unsigned int frame = page_table.find(page_id);
+        if (frame == UINT_MAX)
+        {
+            return;
+        }
+        page_table.erase(page_id);
+        frame_page_id[frame] = UINT_MAX;
+        policy->page_removed(frame);
+        free_frames.push_back(frame);
+    }
+
+    void clear()
+    {
+        for (unsigned int frame = 0; frame < frames.size(); frame++)
+        {
+            if (frame_page_id[frame] != UINT_MAX)
+            {
+                remove(frame_page_id[frame]);
+            }
+        }
+    }
+
+    template <typename Function>
+    void for_each_page(Function f)      //f(page_id, page)
+    {
+        for (unsigned int frame = 0; frame < frames.size(); frame++)
+        {
+            if (frame_page_id[frame] != UINT_MAX)
+            {
+                f(frame_page_id[frame], *frames[frame]);
+            }
+        }
+    }
+};
+
+//pages are spread over the shards by id, so that operations using different pages don't wait for the same latch
+//a shard evicts only its own pages - it needs room for all the pages of the shard pinned at once
+template <typename Page>
+struct Page_buffer
+{
+    vector<unique_ptr<Buffer_shard<Page>>> shards;
+
+    Page_buffer(unsigned int limit, unsigned int shards_num, Policy_type type, void (*write_back_function)(unsigned int, Page&, const string&))
+    {
+        shards_num = max(1u, min(shards_num, limit / SHARD_MIN_PAGES));
+        for (unsigned int i = 0; i < shards_num; i++)
+        {
+            unsigned int frames = limit / shards_num + (i < limit % shards_num ? 1 : 0);
+            shards.push_back(make_unique<Buffer_shard<Page>>(frames, type, write_back_function));
+        }
+    }
+
+    Buffer_shard<Page>& shard(unsigned int page_id)
+    {
+        return *shards[page_id % shards.size()];
+    }
+
+    //latch of the page's shard - held while finding, adding or removing the page
+    mutex& latch(unsigned int page_id)
+    {
+        return shard(page_id).latch;
+    }
+
+    unsigned int size()
+    {
+        unsigned int pages = 0;
+        for (unique_ptr<Buffer_shard<Page>>& s : shards)
+        {
+            pages += s->size();
+        }
+        return pages;
+    }
+
+    //returns pinned page if it's in RAM, nullptr otherwise
+    Page* find(unsigned int page_id)
+    {
+        return shard(page_id).find(page_id);
+    }
+
+    //see Buffer_shard::peek()
+    Page* peek(unsigned int page_id)
+    {
+        return shard(page_id).peek(page_id);
+    }
+
+    //returns frame assigned to the page (to be filled by the caller), nullptr if all the pages of its shard are pinned
+    Page* add(unsigned int page_id, const string& filename)
+    {
+        return shard(page_id).add(page_id, filename);
+    }
+
+    //drops the page without saving it
+    void remove(unsigned int page_id)
+    {
+        shard(page_id).remove(page_id);
+    }
+
+    void clear()
+    {
+        for (unique_ptr<Buffer_shard<Page>>& s : shards)
+        {
+            s->clear();
+        }
+    }
+
+    //page is in the buffer - the caller holds latch(page_id)
+    bool contains(unsigned int page_id)
+    {
+        return shard(page_id).page_table.find(page_id) != UINT_MAX;
+    }
+
+    //latches of all the shards, taken in order (operations hold one at a time)
+    vector<unique_lock<mutex>> latch_all()
+    {
+        vector<unique_lock<mutex>> locks;
+        for (unique_ptr<Buffer_shard<Page>>& s : shards)
+        {
+            locks.emplace_back(s->latch);
+        }
+        return locks;
+    }
+
+    template <typename Function>
+    void for_each_page(Function f)      //f(page_id, page)
+    {
+        for (unique_ptr<Buffer_shard<Page>>& s : shards)
+        {
+            s->for_each_page(f);
+        }
+    }
+
+    string policy_name()
+    {
+        return shards[0]->policy->name();
+    }
+    unsigned long long hits()
+    {
+        unsigned long long count = 0;
+        for (unique_ptr<Buffer_shard<Page>>& s : shards)
+        {
+            count += s->policy->hits;
+        }
+        return count;
+    }
+    unsigned long long misses()
+    {
+        unsigned long long count = 0;
+        for (unique_ptr<Buffer_shard<Page>>& s : shards)
+        {
+            count += s->policy->misses;
+        }
+        return count;
+    }
+};
+
+Page_buffer<B_tree_page> index_buffer(INDEX_BUFFER_LIMIT, INDEX_BUFFER_SHARDS, INDEX_BUFFER_POLICY, write_index_page);
+Page_buffer<Data_page> data_buffer(DATA_BUFFER_LIMIT, 1, DATA_BUFFER_POLICY, write_data_page);     //data pages are used under data_latch anyway
+
+
+//WRITE-AHEAD LOG
+
+
+#define     WAL_PAGE_RECORD     1       //image of a page
+#define     WAL_COMMIT_RECORD   2       //end of a group of operations, metadata follows
+
+//every log record starts with this header
+struct Wal_record_header
+{
+    unsigned long long lsn;
+    unsigned int type;
+    unsigned int file;          //number in Write_ahead_log::filenames
+    unsigned int page_id;
+    unsigned int size;          //bytes following the header
+    unsigned int checksum;      //of the bytes following the header - a torn record at the end of the log is ignored
+    unsigned int reserved;
+};
+
+unsigned int wal_checksum(const char* bytes, size_t size)     //FNV-1a
+{
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash = (hash ^ (unsigned char)bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+//redo log of whole page images, no page gets to index.dat/data.dat before the log records describing it are on disk:
+//- while logging, writing a page only saves its image in RAM (reads see the saved images too)
+//- commit() adds images of all dirty buffered pages, so the operation is complete in the saved images
+//- every WAL_GROUP_COMMIT operations flush() appends the images and a commit record to the log,
+//  syncs it once for the whole group and only then writes the pages to their files
+//after a crash recover() redoes every group that has its commit record, the rest is dropped
+struct Write_ahead_log
+{
+    Page_file* log = nullptr;
+    bool logging = false;
+    vector<string> filenames;       //files whose pages are logged
+    map<pair<unsigned int, unsigned int>, vector<char>> images;     //(file, page id) -> latest image, not in the log yet
+    mutex images_latch;     //pages are written and read by concurrent operations
+    unsigned long long next_lsn = 1;
+    unsigned long long flushed_lsn = 0;     //records up to this one are on disk
+    unsigned long long operations = 0;      //committed operations
+    unsigned int group_operations = 0;      //committed, but not in the log yet
+    vector<unsigned int> meta;      //root, next ids, free list head and length at the last commit
+    atomic<bool> checkpoint_requested{false};       //by the page cleaner - the next commit flushes the group and checkpoints
+    off_t log_end = 0;
+    unsigned long long syncs = 0;
+
+    bool open(const string& filename, const vector<string>& logged_files)
+    {
+        log = get_page_file(filename);
+        if (!log)
+        {
+            return false;
+        }
+        filenames = logged_files;
+        log_end = log->file_size();
+        return true;
+    }
+
+    int file_number(Page_file* file)
+    {
+        for (unsigned int i = 0; i < filenames.size(); i++)
+        {
+            if (filenames[i] == file->filename)
+            {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    //returns false if the page isn't logged and should be written to the file
+    bool save_image(Page_file* file, unsigned int page_id, const char* image, size_t size)
+    {
+        int number = logging ? file_number(file) : -1;
+        if (number < 0)
+        {
+            return false;
+        }
+        lock_guard<mutex> lock(images_latch);
+        images[{(unsigned int)number, page_id}].assign(image, image + size);
+        return true;
+    }
+
+    //returns false if there is no saved image of the page
+    bool find_image(Page_file* file, unsigned int page_id, char* image, size_t size)
+    {
+        lock_guard<mutex> lock(images_latch);
+        if (images.empty())
+        {
+            return false;
+        }
+        int number = file_number(file);
+        if (number < 0)
+        {
+            return false;
+        }
+        map<pair<unsigned int, unsigned int>, vector<char>>::iterator it = images.find({(unsigned int)number, page_id});
+        if (it == images.end() || it->second.size() != size)
+        {
+            return false;
+        }
+        memcpy(image, it->second.data(), size);
+        return true;
+    }
+
+    //ends an operation - called after every operation on the tree
+    void commit(unsigned int root)
+    {
+        if (!logging)
+        {
+            return;
+        }
+        flush_all_buffers(DATA_DAT_FILENAME, INDEX_DAT_FILENAME);       //dirty pages become saved images
+        meta = {root, next_page_id, free_list_head, next_data_page_id, free_index_pages};
+        operations++;
+        group_operations++;
+        if (group_operations >= WAL_GROUP_COMMIT || checkpoint_requested)
+        {
+            flush();
+        }
+    }
+
+    void append_record(vector<char>& out, unsigned int type, unsigned int file, unsigned int page_id, const char* bytes, size_t size)
+    {
+        Wal_record_header header;
+        memset(&header, 0, sizeof(Wal_record_header));
+        header.lsn = next_lsn++;
+        header.type = type;
+        header.file = file;
+        header.page_id = page_id;
+        header.size = size;
+        header.checksum = wal_checksum(bytes, size);
+        const char* h = reinterpret_cast<const char*>(&header);
+        out.insert(out.end(), h, h + sizeof(Wal_record_header));
+        out.insert(out.end(), bytes, bytes + size);
+    }
+
+    //group commit - one log write and one sync for all operations committed since the last flush
+    void flush()
+    {
+        if (group_operations == 0)
+        {
+            return;
+        }
+        vector<char> out;
+        for (map<pair<unsigned int, unsigned int>, vector<char>>::iterator it = images.begin(); it != images.end(); it++)
+        {
+            append_record(out, WAL_PAGE_RECORD, it->first.first, it->first.second, it->second.data(), it->second.size());
+        }
+        append_record(out, WAL_COMMIT_RECORD, 0, 0, reinterpret_cast<const char*>(meta.data()), meta.size() * sizeof(unsigned int));
+        if (!log->write_at(log_end, out.data(), out.size()) || !log->sync_file())
+        {
+            cerr << "Error: Couldn't write the log, pages stay in RAM" << endl;
+            return;
+        }
+        log_end += out.size();
+        flushed_lsn = next_lsn - 1;
+        syncs++;
+
+        //the group is durable - pages can go to their files
+        for (map<pair<unsigned int, unsigned int>, vector<char>>::iterator it = images.begin(); it != images.end(); it++)
+        {
+            get_page_file(filenames[it->first.first])->write_page(it->first.second, it->second.data(), it->second.size());
+        }
+        images.clear();
+        group_operations = 0;
+
+        if (log_end >= WAL_CHECKPOINT_BYTES || checkpoint_requested.exchange(false))
+        {
+            save_tree_meta(meta[0], true);      //log is emptied - headers have to describe the files
+            checkpoint();
+        }
+    }
+
+    //once the files are synced the log isn't needed anymore
+    void checkpoint()
+    {
+        for (unsigned int i = 0; i < filenames.size(); i++)
+        {
+            get_page_file(filenames[i])->sync_file();
+        }
+        log->truncate_file();
+        log->sync_file();
+        log_end = 0;
+        syncs++;
+    }
+
+    //redoes complete groups from the log, returns true if any of them was found (root, next ids etc. are then restored
+//and saved in the file headers)
+    bool recover(unsigned int& root)
+    {
+        off_t pos = 0;
+        bool recovered = false;
+        vector<pair<Wal_record_header, vector<char>>> group;
+        Wal_record_header header;
+        while (log->read_at(pos, &header, sizeof(Wal_record_header)))
+        {
+            vector<char> bytes(header.size);
+            if (header.size > 0 && !log->read_at(pos + sizeof(Wal_record_header), bytes.data(), header.size))
+            {
+                break;
+            }
+            if (header.checksum != wal_checksum(bytes.data(), bytes.size()) || header.lsn < next_lsn || header.file >= filenames.size())
+            {
+                break;      //torn write at the end of the log
+            }
+            pos += sizeof(Wal_record_header) + header.size;
+            next_lsn = header.lsn + 1;
+            if (header.type == WAL_PAGE_RECORD)
+            {
+                group.push_back({header, bytes});
+                continue;
+            }
+            for (unsigned int i = 0; i < group.size(); i++)
+            {
+                get_page_file(filenames[group[i].first.file])->write_page(group[i].first.page_id, group[i].second.data(), group[i].second.size());
+            }
+            group.clear();
+            meta.assign(header.size / sizeof(unsigned int), 0);
+            memcpy(meta.data(), bytes.data(), meta.size() * sizeof(unsigned int));
+            recovered = true;
+        }
+        if (recovered)
+        {
+            root = meta[0];
+            next_page_id = meta[1];
+            free_list_head = meta[2];
+            next_data_page_id = meta[3];
+            free_index_pages = meta[4];
+            free_space_map.clear();
+            free_space_map.valid = false;       //data pages are read again when the tree is opened
+            save_tree_meta(root, true);
+        }
+        flushed_lsn = next_lsn - 1;
+        checkpoint();
+        return recovered;
+    }
+};
+
+Write_ahead_log wal;
+
+
+//FUNCTIONS
+
+
+//returns new pinned data page created in the buffer (saved to the disk when evicted or flushed)
+Data_page* init_data_page()
+{
+    Data_page* dpage = data_buffer.add(next_data_page_id, DATA_DAT_FILENAME);
+    if(!dpage)
+    {
+        cerr<<"Error: Data pages buffer is too small to handle operation (all pages are being used). Try setting higher DATA_BUFFER_LIMIT."<<endl;
+        return nullptr;
+    }
+    dpage->init_storage();
+    dpage->rec_num = 0;
+    dpage->id = next_data_page_id;
+    dpage->dirty = true;
+    dpage->pin_count = 1;
+    dpage->free_all_slots();
+    for(int i = 0; i<tree_config.data_page_records; i++)
+    {
+        dpage->records[i] = {no_key, {-1, -1, -1, -1, -1}};
+    }
+    free_space_map.set(dpage->id, true);
+    next_data_page_id++;
+    return dpage;
+}
+
+//returns id of data page and offset
+pair <unsigned int, unsigned int> insert_rec_in_data_dat(Record rec)
+{
+    lock_guard<mutex> lock(data_latch);
+    unsigned int dpage_id = free_space_map.first();
+    Data_page* dpage_p;
+    if(dpage_id != UINT_MAX)
+    {
+        dpage_p = get_data_page(dpage_id, DATA_DAT_FILENAME);
+    }
+    else
+    {
+        dpage_id = next_data_page_id;
+        dpage_p = init_data_page();
+    }
+    if(!dpage_p)
+    {
+        return {UINT_MAX, UINT_MAX};
+    }
+    unsigned int i = dpage_p->first_free_slot();
+    if(i == UINT_MAX)
+    {
+        cerr << "Error: Data page " << dpage_id << " has no free slot, inconsistent free-space map" << endl;
+        free_space_map.set(dpage_id, false);
+        dpage_p->pin_count--;
+        return {UINT_MAX, UINT_MAX};
+    }
+    dpage_p->records[i] = rec;
+    dpage_p->set_slot_free(i, false);
+    if(dpage_p->first_free_slot() == UINT_MAX)        //no more free slots left
+    {
+        free_space_map.set(dpage_id, false);
+    }
+    dpage_p->dirty = true;
+    dpage_p->rec_num++;
+    dpage_p->pin_count--;
+    data_records++;
+    return {dpage_id, i};
+}
+
+//puts the record where the tree keeps it - data.dat, or (clustered tree) the index record itself, which goes to a leaf
+B_tree_record place_record(const Record& rec)
+{
+    if (tree_config.clustered)
+    {
+        B_tree_record placed = {rec.key, UINT_MAX, UINT_MAX};
+        copy_n(rec.sides, 5, placed.sides);
+        return placed;
+    }
+    pair<unsigned int, unsigned int> position = insert_rec_in_data_dat(rec);
+    return {rec.key, position.first, position.second};
+}
+
+//frees the data.dat slot taken by place_record() for a record that didn't get into the tree
+void release_placed_record(const B_tree_record& rec)
+{
+    if (rec.page_id != UINT_MAX)
+    {
+        remove_rec_from_data_dat(rec);
+    }
+}
+
+//a single insert goes the usual way, more of them as a batch
+void apply_reads(vector<Key>& batch, B_tree* tree)
+{
+    if (batch.size() > 1)
+    {
+        tree->read_ahead(batch);
+    }
+    for (const Key& key : batch)
+    {
+        tree->read_record(key);
+    }
+    batch.clear();
+}
+
+void apply_inserts(vector<Record>& batch, B_tree* tree)
+{
+    if (batch.size() == 1)
+    {
+        tree->insert(place_record(batch[0]));
+        wal.commit(tree->root);
+    }
+    else if (batch.size() > 1)
+    {
+        tree->insert_batch(batch);
+        wal.commit(tree->root);
+    }
+    batch.clear();
+}
+
+//key written in the operations file, no_key if there's none
+Key parse_key(const string& text)
+{
+    stringstream ss(text);
+    Key key = no_key;
+    ss >> key;
+    return key;
+}
+
+void process_operations(const string& filename, B_tree* tree)
+{
+    ifstream in(filename);
+    if (!in.is_open())
+    {
+        cerr << "Error: Couldn't open operations file " << filename << endl;
+        return;
+    }
+
+    string line;
+    vector<Record> batch;       //consecutive inserts are applied together
+    vector<Key> reads;      //consecutive reads get their pages read ahead together
+    while (getline(in, line))
+    {
+        if (line.empty()) continue;
+
+        if (line.rfind("insert(", 0) != 0 || batch.size() == INSERT_BATCH_SIZE)
+        {
+            apply_inserts(batch, tree);
+        }
+        if (line.rfind("read(", 0) != 0 || reads.size() == READ_BATCH_SIZE)
+        {
+            apply_reads(reads, tree);
+        }
+
+        // INSERT
+        if (line.rfind("insert(", 0) == 0)
+        {
+            line = line.substr(7, line.size() - 8);
+
+            stringstream ss(line);
+
+            Record r;
+            ss >> r.key;
+            for (int i = 0; i < 5; i++)
+                ss >> r.sides[i];
+
+            if (!key_fits(r.key))
+            {
+                cerr << "Error: Key " << r.key << " is longer than " << Key_traits<Key>::max_bytes() << " bytes" << endl;
+                continue;
+            }
+            batch.push_back(r);
+        }
+
+        // REMOVE
+        else if (line.rfind("remove(", 0) == 0)
+        {
+            line = line.substr(7, line.size() - 8);
+
+            tree->remove(parse_key(line));
+            wal.commit(tree->root);
+            //compaction and defragmentation run here, in the remove that left the files sparse, under the exclusive tree latch
+            if (data_dat_sparse())
+            {
+                compact_data_dat(tree);
             }
-            if(!is_leaf())
+            if (index_dat_sparse())
             {
-                sibling->children_id[med] = all_children[med];
+                defragment_index_dat(tree);
             }
-            sibling->keys_num = med;
-            //parent
-            parent->keys[sibling_id] = all_keys[med];
-            //right
-            int j = 0;
-            for (i = med+1; i<all_keys_num; i++)
+        }
+
+        else if (line.rfind("update(", 0)==0)
+        {
+            line = line.substr(7, line.size() - 8);
+            stringstream ss(line);
+            Record r;
+            ss>>r.key;
+            for (int i = 0; i < 5; i++)
+                ss >> r.sides[i];
+
+            tree->update_record(r);
+            wal.commit(tree->root);
+        }
+
+        else if (line.rfind("read(", 0)==0)
+        {
+            line = line.substr(5, line.size() - 6);
+
+            reads.push_back(parse_key(line));
+        }
+
+        // SCAN - scan(lo hi) prints records in ascending order, scan(hi lo) in descending
+        else if (line.rfind("scan(", 0)==0)
+        {
+            line = line.substr(5, line.size() - 6);
+            stringstream ss(line);
+            Key from = no_key, to = no_key;
+            ss >> from >> to;
+
+            bool descending = key_less(to, from);
+            tree->scan(descending ? to : from, descending ? from : to, [](const Record& r)
+            {
+                cout << r.key << ": ";
+                for (int i = 0; i < 5; i++)
+                {
+                    cout << r.sides[i] << " ";
+                }
+                cout << endl;
+            }, descending);
+        }
+
+        // COMPACT - compact() repacks data.dat whatever its fill
+        else if (line.rfind("compact(", 0)==0)
+        {
+            compact_data_dat(tree);
+        }
+
+        // DEFRAGMENT - defragment() renumbers pages of index.dat whatever the length of the free list
+        else if (line.rfind("defragment(", 0)==0)
+        {
+            defragment_index_dat(tree);
+        }
+
+        else
+        {
+            cerr << "Unknown operation: " << line << endl;
+        }
+    }
+    apply_inserts(batch, tree);
+    apply_reads(reads, tree);
+
+    in.close();
+}
+
+
+//create data pages on disk
+void txt_to_dat(const string &txt, const string &dat) {
+    ifstream in(txt);
+    Page_file* out = get_page_file(dat);
+
+    if (!in.is_open()) {
+        cerr << "Error: Couldn't open .txt file"<< endl;
+        return;
+    }
+    if (!out) {
+        cerr << "Error: Couldn't open .dat file" << endl;
+        return;
+    }
+    out->truncate_file();       //file will be overwritten
+    data_buffer.clear();
+    next_data_page_id = 0;
+    data_records = 0;
+    free_space_map.clear();
+    write_file_header(out, DATA_FILE_MAGIC, UINT_MAX, false);
+
+    Data_page current_page;
+    current_page.init_storage();
+    Record r;
+    while (true) {
+        current_page.rec_num = 0;
+        current_page.id = next_data_page_id;
+        current_page.dirty = false;
+        current_page.pin_count = 0;
+        current_page.free_all_slots();
+        for(int i = 0; i<tree_config.data_page_records; i++)
+        {           
+            if (!(in >> r.key)) 
             {
-                keys[j] = all_keys[i];
-                if(!is_leaf())
+                if (current_page.rec_num > 0)       //empty page isn't saved
                 {
-                    children_id[j] = all_children[i];
+                    free_space_map.set(current_page.id, true);
                 }
-                j++;
+                break;      //eof
+            }
+            for (int j = 0; j < 5; j++)
+            {
+                in >> r.sides[j];
             }
-            keys_num = all_keys_num - 1 - med;
-            if(!is_leaf())
+            if (!key_fits(r.key))
             {
-                children_id[sibling->keys_num] = all_children[all_keys_num];
+                cerr << "Error: Key " << r.key << " is longer than " << Key_traits<Key>::max_bytes() << " bytes, record skipped" << endl;
+                i--;
+                continue;
             }
+                current_page.records[i] = r;
+                current_page.rec_num++;
+                current_page.set_slot_free(i, false);
+                data_records++;
+        }
+        if (current_page.rec_num == 0)
+        {
+            break;
         }
+        store_data_page(out, current_page.id, current_page);
+        next_data_page_id++;
+    }
+    in.close();
+}
 
-        //AND setting children's parent ids
-        if(!is_leaf())
+mutex allocation_latch;      //next_page_id and the free list of index pages are changed by concurrent inserts one at a time
+//it's never held while a page is latched by it - splits and merges allocate with their pages latched
+
+//returns new pinned page created in the buffer (saved to the disk when evicted or flushed)
+//the first of the free pages is taken if there are any
+B_tree_page* new_index_page()
+{
+    B_tree_page* page;
+    {
+        lock_guard<mutex> lock(allocation_latch);
+        if(free_list_head != UINT_MAX)
         {
-            for(int i = 0; i<keys_num+1; i++)
+            //only pinned - next_free is changed under allocation_latch alone and the page off the list can't be reached
+            //by anyone else, so it's latched after the list is unlocked
+            page = pin_index_page(free_list_head, INDEX_DAT_FILENAME);
+            if(!page)
             {
-                B_tree_page* current_child = get_index_page(children_id[i], INDEX_DAT_FILENAME);
-                current_child->dirty = true;
-                current_child->parent_id = id;
-                current_child->pin_count--;       
+                return nullptr;
             }
-            for(int i = 0; i<sibling->keys_num+1; i++)
+            free_list_head = page->next_free;
+            free_index_pages--;
+        }
+        else
+        {
+            lock_guard<mutex> buffer_lock(index_buffer.latch(next_page_id));
+            page = index_buffer.add(next_page_id, INDEX_DAT_FILENAME);
+            if(!page)
             {
-                B_tree_page* current_child = get_index_page(sibling->children_id[i], INDEX_DAT_FILENAME);
-                current_child->dirty = true;
-                current_child->parent_id = sibling->id;
-                current_child->pin_count--;
+                cerr<<"Error: Index pages buffer is too small to handle operation (all pages are being used). Try setting higher INDEX_BUFFER_LIMIT."<<endl;
+                return nullptr;
             }
+            page->version.begin_change();
+            page->id = next_page_id;
+            page->pin_count = 1;
+            page->version.end_change();
+            next_page_id++;
         }
-        /*write_index_page(id, *this, INDEX_DAT_FILENAME);
-        write_index_page(sibling.id, sibling, INDEX_DAT_FILENAME);
-        write_index_page(parent_id, parent, INDEX_DAT_FILENAME);*/
-        dirty = true;
-        sibling->dirty = true;
-        parent->dirty = true;
-        parent->pin_count--;
-        sibling->pin_count--;
-        delete[] all_keys;
-        delete[] all_children;
     }
-    void split()
+    latch_index_page(page);     //nobody else has it yet, it's released like the fetched pages
+    page->reset();
+    page->dirty = true;
+    return page;
+}
+
+void free_index_page(unsigned int id)
+{
+    B_tree_page* page = get_index_page(id, INDEX_DAT_FILENAME);        //latched before allocation_latch is taken
+    if (!page) 
+    {
+        return;
+    }
+    lock_guard<mutex> lock(allocation_latch);
+
+    if (id == next_page_id - 1 && page->pin_count == 1)        //last page of index.dat - it's dropped instead
+    {
+        release_index_page(page);
+        lock_guard<mutex> buffer_lock(index_buffer.latch(id));
+        index_buffer.remove(id);
+        next_page_id--;
+        return;
+    }
+    page->next_free = free_list_head;
+    page->dirty = true;
+    free_list_head = id;
+    free_index_pages++;
+    release_index_page(page);
+}
+
+
+//bytes of a key in the page size formulas below, variable-length keys are counted with their slot and as long as they can be
+unsigned int index_key_bytes()
+{
+    return Key_traits<Key>::fixed_size ? sizeof(Key) : SLOT_BYTES + Key_traits<Key>::max_bytes();
+}
+
+//bytes taken on disk by index page: id, keys_num, next_free, keys[max_keys+1], pointers[max_keys+1], children_id[max_keys+2]
+unsigned int index_page_size(unsigned int max_keys)
+{
+    return 3 * sizeof(unsigned int) + (max_keys + 1) * (index_key_bytes() + sizeof(Record_pointer)) + (max_keys + 2) * sizeof(unsigned int);
+}
+
+//B+-tree pages: id, keys_num, next_free, prev_leaf, next_leaf, leaf flag, then
+//leaf: keys[max_keys+1], pointers[max_keys+1]
+unsigned int bplus_leaf_page_size(unsigned int max_keys)
+{
+    return 6 * sizeof(unsigned int) + (max_keys + 1) * (index_key_bytes() + sizeof(Record_pointer));
+}
+
+//clustered tree leaf: keys[max_keys+1], sides of the records[max_keys+1]
+unsigned int clustered_leaf_page_size(unsigned int max_keys)
+{
+    return 6 * sizeof(unsigned int) + (max_keys + 1) * (index_key_bytes() + sizeof(Record::sides));
+}
+
+//upper page: separator keys[max_keys+1] (without record pointers), children_id[max_keys+2]
+unsigned int bplus_interior_page_size(unsigned int max_keys)
+{
+    return 6 * sizeof(unsigned int) + (max_keys + 1) * index_key_bytes() + (max_keys + 2) * sizeof(unsigned int);
+}
+
+//bytes of a record in data page: key (variable-length one after its length byte, padded to the longest) and sides
+unsigned int record_bytes()
+{
+    return (Key_traits<Key>::fixed_size ? 0 : 1) + Key_traits<Key>::max_bytes() + sizeof(Record::sides);
+}
+
+//bytes taken on disk by data page: id, rec_num, records[], free slots (bit per slot)
+unsigned int data_page_size(unsigned int records)
+{
+    return 2 * sizeof(unsigned int) + records * record_bytes() + (records + 7) / 8;
+}
+
+//d = 0 means the highest degree whose index page fits in INDEX_PAGE_BYTES
+//data_page_records = 0 means as many records as keys in index page
+//in B+-tree d is the degree of leaves, upper pages get the highest degree that fits in the same page size
+//compressed pages (B+-tree only) take as many bytes as the uncompressed ones of degree d, the limits of keys change:
+//min - half of the keys that fit even if nothing compresses, so any split or merge result can be made to fit,
+//max - as many keys as fit if all of them compress as well as possible
+//variable-length keys (B+-tree only) are kept in slotted pages of the same size, with limits chosen the same way
+//compression needs 32-bit keys in ascending order, clustered trees (B+-tree only) aren't compressed
+Tree_config make_tree_config(unsigned int d, unsigned int data_page_records, bool bplus_tree, bool compressed_pages, bool clustered)
+{
+    bplus_tree = bplus_tree || !Key_traits<Key>::fixed_size || clustered;
+    unsigned int (*page_size)(unsigned int) = clustered ? clustered_leaf_page_size : bplus_tree ? bplus_leaf_page_size : index_page_size;
+    if (d == 0)
     {
-        if(keys_num<= MAX_KEYS)
+        d = 1;
+        while (page_size(2 * (d + 1)) <= INDEX_PAGE_BYTES)
         {
-            cout<<"Error: split() function called on a wrong node!"<<endl;          //backup just in case
-            return;
+            d++;
         }
-
-        //filling new page
-        B_tree_page new_page_s;
-        B_tree_page* new_page = &new_page_s;
-        init_B_tree_page(new_page);        //it's going to be page on the right side
-        unsigned int med = keys_num / 2;
-        new_page->dirty = true;
-        new_page->pin_count++;
-        for(int i = 0; i<keys_num-med-1;i++)
+    }
+    Tree_config config;
+    config.d = d;
+    config.min_keys = d;
+    config.max_keys = 2 * d;
+    config.bplus_tree = bplus_tree;
+    config.index_page_size = page_size(config.max_keys);
+    config.min_interior_keys = d;
+    if (bplus_tree)
+    {
+        while (bplus_interior_page_size(2 * (config.min_interior_keys + 1)) <= config.index_page_size)
         {
-            new_page->keys[i] = keys[med+1+i];        //moving keys to the new page
-            new_page->children_id[i] = children_id[med+1+i];
-            if(!is_leaf())
-            {
-                B_tree_page* current_child = get_index_page(new_page->children_id[i], INDEX_DAT_FILENAME);
-                current_child->parent_id = new_page->id;
-                current_child->dirty = true;
-                current_child->pin_count--;
-            }
-            keys[med+1+i] = {UINT_MAX, UINT_MAX, UINT_MAX};       //clearing spot
-            children_id[med+1+i] = UINT_MAX;
+            config.min_interior_keys++;
         }
-        new_page->keys_num = keys_num - med - 1;
-        new_page->children_id[new_page->keys_num] =children_id[keys_num];       //last child covered 
-        new_page->pin_count--;
-
-        if(!is_leaf())
+    }
+    config.max_interior_keys = 2 * config.min_interior_keys;
+    config.data_page_records = data_page_records != 0 ? data_page_records : config.max_keys;
+    config.data_page_size = data_page_size(config.data_page_records);
+    config.clustered = clustered;
+    config.compressed_pages = compressed_pages && bplus_tree && !clustered && Key_traits<Key>::compressible && is_same<Key_compare, less<Key>>::value;
+    config.sized_pages = config.compressed_pages || !Key_traits<Key>::fixed_size;
+    if (config.compressed_pages)
+    {
+        unsigned int bytes = config.index_page_size - COMPRESSED_HEADER_BYTES;
+        unsigned int leaf_key_bytes = sizeof(unsigned int) + 2 * COMPRESSED_MAX_VARINT;      //difference, page_id and offset
+        unsigned int interior_key_bytes = sizeof(unsigned int) + COMPRESSED_MAX_VARINT;      //difference and child, one more child
+        config.min_keys = max(1u, bytes / leaf_key_bytes / 2);
+        config.max_keys = bytes / 2;        //at least a byte for each of the varints
+        config.min_interior_keys = max(1u, (bytes - COMPRESSED_MAX_VARINT) / interior_key_bytes / 2);
+        config.max_interior_keys = bytes - 1;
+    }
+    else if (config.sized_pages)
+    {
+        if (config.index_page_size > USHRT_MAX)
         {
-            B_tree_page* last_child = get_index_page(new_page->children_id[new_page->keys_num], INDEX_DAT_FILENAME);
-            last_child->parent_id = new_page->id;
-            last_child->pin_count--;
+            cerr << "Error: Slotted index pages can't be bigger than " << USHRT_MAX << " bytes" << endl;
         }
-        children_id[keys_num] = UINT_MAX;
-        keys_num = med;
+        unsigned int bytes = config.index_page_size - SLOTTED_HEADER_BYTES;
+        unsigned int longest_key = SLOT_BYTES + Key_traits<Key>::max_bytes();
+        unsigned int value = clustered ? sizeof(Record::sides) : sizeof(Record_pointer);
+        config.min_keys = max(1u, bytes / (longest_key + value) / 2);
+        config.max_keys = bytes / (SLOT_BYTES + value);        //all the keys empty
+        config.min_interior_keys = max(1u, (bytes - (unsigned int)sizeof(unsigned int)) / (longest_key + (unsigned int)sizeof(unsigned int)) / 2);
+        config.max_interior_keys = (bytes - sizeof(unsigned int)) / (SLOT_BYTES + sizeof(unsigned int));
+    }
+    //split_many spreads the keys among pages of at most 2 * min_keys keys in the worst case, the page split could have got
+    //that many keys from its own child before
+    config.split_separators = 1;
+    if (config.sized_pages)
+    {
+        unsigned int most_keys = max(config.max_keys, config.max_interior_keys);
+        unsigned int least_keys = 2 * min(config.min_keys, config.min_interior_keys);
+        unsigned int previous = 0;
+        while (previous != config.split_separators)
+        {
+            previous = config.split_separators;
+            config.split_separators = max(1u, (most_keys + previous + least_keys - 1) / least_keys - 1);
+        }
+    }
+    return config;
+}
 
-        dirty = true;
-        new_page->dirty = true;
+//saves layout of the pages (kept from the current header if the file has one) and root, next ids, free list head
+//and pages with free slots taken from the globals
+void write_file_header(Page_file* file, unsigned int magic, unsigned int root, bool clean)
+{
+    File_header header;
+    if (!read_file_header(file, magic, header))
+    {
+        memset(&header, 0, sizeof(File_header));
+        header.magic = magic;
+        header.version = FILE_VERSION;
+        header.page_size = magic == INDEX_FILE_MAGIC ? tree_config.index_page_size : tree_config.data_page_size;
+        header.d = tree_config.d;
+        header.data_page_records = tree_config.data_page_records;
+        header.bplus_tree = tree_config.bplus_tree ? 1 : 0;
+        header.compressed_pages = tree_config.compressed_pages ? 1 : 0;
+        header.clustered = tree_config.clustered ? 1 : 0;
+        header.key_type = Key_traits<Key>::id;
+    }
+    header.clean = clean ? 1 : 0;
+    header.root = root;
+    header.next_page_id = next_page_id;
+    header.free_list_head = free_list_head;
+    header.free_index_pages = free_index_pages;
+    header.next_data_page_id = next_data_page_id;
+    header.data_records = data_records;
+
+    vector<char> block(FILE_HEADER_SIZE, 0);
+    memcpy(block.data(), &header, sizeof(File_header));
+    file->write_header(block.data(), block.size());
+}
 
-        //moving key to the parent and connecting the parent with the new page
-        B_tree_page parent_s;
-        B_tree_page* parent = &parent_s;
-        int i = 0;
-        if(!is_root())
+//FREE_SPACE_MAP_FILENAME: magic, number of data pages it describes (UINT_MAX if it has to be rebuilt), words of the map
+//saved before the header of data.dat says the files are clean, so it's trusted only if it describes all the data pages
+void save_free_space_map(bool clean)
+{
+    Page_file* file = get_page_file(FREE_SPACE_MAP_FILENAME);
+    if (!file)
+    {
+        return;
+    }
+    unsigned int header[2] = {FREE_SPACE_MAP_MAGIC, clean && free_space_map.valid ? next_data_page_id : UINT_MAX};
+    if (header[1] != UINT_MAX)
+    {
+        vector<unsigned long long> words((next_data_page_id + 63) / 64, 0);
+        copy_n(free_space_map.words.begin(), min(words.size(), free_space_map.words.size()), words.begin());
+        file->write_at(sizeof(header), words.data(), words.size() * sizeof(unsigned long long));
+        file->sync_file();
+    }
+    file->write_at(0, header, sizeof(header));
+    if (clean)
+    {
+        file->sync_file();
+    }
+}
+
+//returns false if the saved map doesn't describe data_pages pages
+bool load_free_space_map(unsigned int data_pages)
+{
+    Page_file* file = get_page_file(FREE_SPACE_MAP_FILENAME);
+    unsigned int header[2];
+    if (!file || !file->read_at(0, header, sizeof(header)) || header[0] != FREE_SPACE_MAP_MAGIC || header[1] != data_pages)
+    {
+        return false;
+    }
+    vector<unsigned long long> words((data_pages + 63) / 64);
+    if (!file->read_at(sizeof(header), words.data(), words.size() * sizeof(unsigned long long)))
+    {
+        return false;
+    }
+    free_space_map.assign(words);
+    return true;
+}
+
+//reads all the data pages, live records are counted again on the way
+void rebuild_free_space_map(Page_file* data, unsigned int data_pages)
+{
+    free_space_map.clear();
+    data_records = 0;
+    Data_page dpage;
+    for (unsigned int dpage_id = 0; dpage_id < data_pages && load_data_page(data, dpage_id, dpage); dpage_id++)
+    {
+        free_space_map.set(dpage_id, dpage.first_free_slot() != UINT_MAX);
+        data_records += dpage.rec_num;
+    }
+}
+
+//saves the globals describing the tree in headers of index.dat and data.dat
+//clean - false if the files are going to be changed without the log, so that the headers aren't trusted after a crash
+void save_tree_meta(unsigned int root, bool clean)
+{
+    Page_file* index = get_page_file(INDEX_DAT_FILENAME);
+    Page_file* data = get_page_file(DATA_DAT_FILENAME);
+    if (!index || !data)
+    {
+        return;
+    }
+    if (clean)      //pages go to the disk before headers describing them
+    {
+        index->sync_file();
+        data->sync_file();
+    }
+    save_free_space_map(clean);
+    write_file_header(index, INDEX_FILE_MAGIC, root, clean);
+    write_file_header(data, DATA_FILE_MAGIC, root, clean);
+}
+
+//returns false if the file doesn't start with a valid header
+bool read_file_header(Page_file* file, unsigned int magic, File_header& header)
+{
+    return file->read_header(&header, sizeof(File_header)) && header.magic == magic && header.version == FILE_VERSION;
+}
+
+thread_local vector<char> page_io_buffer;       //pages are encoded here before writing and decoded after reading
+
+void put_bytes(char*& pos, const void* src, size_t size)
+{
+    memcpy(pos, src, size);
+    pos += size;
+}
+
+void get_bytes(const char*& pos, void* dst, size_t size)
+{
+    memcpy(dst, pos, size);
+    pos += size;
+}
+
+//page images go through the log while it's on
+bool read_page_image(Page_file* file, unsigned int page_id, unsigned int size)
+{
+    return wal.find_image(file, page_id, page_io_buffer.data(), size) || file->read_page(page_id, page_io_buffer.data(), size);
+}
+
+void write_page_image(Page_file* file, unsigned int page_id, unsigned int size)
+{
+    if (wal.save_image(file, page_id, page_io_buffer.data(), size))
+    {
+        return;
+    }
+    if (write_batch)
+    {
+        write_batch->add(file, page_id, page_io_buffer.data(), size);
+    }
+    else
+    {
+        file->write_page(page_id, page_io_buffer.data(), size);
+    }
+}
+
+void put_varint(char*& pos, unsigned int value)
+{
+    while (value >= 0x80)
+    {
+        *pos++ = (char)(value | 0x80);
+        value >>= 7;
+    }
+    *pos++ = (char)value;
+}
+
+unsigned int get_varint(const char*& pos)
+{
+    unsigned int value = 0;
+    for (unsigned int shift = 0; shift < 35; shift += 7)
+    {
+        unsigned char byte = *pos++;
+        value |= (unsigned int)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
         {
-            parent = get_index_page(parent_id, INDEX_DAT_FILENAME);
-            while(parent->children_id[i] != id)
-            {
-                i++;
-            }
-            //i now is index of the page in the children_id array of the parent
-            for(int j = parent->keys_num; j>i; j--)
-            {
-                parent->keys[j] = parent->keys[j-1];
-                parent->children_id[j+1] = parent->children_id[j];      //moving all keys and children to the right side
-            }
-            parent->children_id[i+1] = new_page->id;      //adding new page as a child
-            new_page->parent_id = parent->id;
-            parent->keys[i] = keys[med];
-            parent->keys_num += 1;
-            parent->dirty = true;
-            keys[med] = {UINT_MAX, UINT_MAX, UINT_MAX};
+            break;
+        }
+    }
+    return value;
+}
 
-            //overflow
-            if(parent->keys_num > MAX_KEYS)
-            {
-                unsigned int free_sibling_id = parent->compensation_possible();
-                if(free_sibling_id != UINT_MAX)
-                {
-                    parent->compensate(free_sibling_id);
-                }
-                else
-                {
-                    parent->split();
-                }
-            }
+//keys of a compressed page (described at COMPRESSED_HEADER_BYTES) with their record pointers or children
+void put_compressed_keys(char*& pos, const B_tree_page& page, bool leaf)
+{
+    Key first = page.keys_num > 0 ? page.keys[0] : Key_traits<Key>::from_number(0);
+    unsigned char width = page.keys_num > 0 ? bit_width(Key_traits<Key>::difference(first, page.keys[page.keys_num - 1])) : 0;
+    Key_traits<Key>::put(pos, first);
+    put_bytes(pos, &width, 1);
+    unsigned long long bits = 0;
+    unsigned int bits_num = 0;
+    for (unsigned int i = 0; i < page.keys_num; i++)
+    {
+        bits |= (unsigned long long)Key_traits<Key>::difference(first, page.keys[i]) << bits_num;
+        bits_num += width;
+        for (; bits_num >= 8; bits_num -= 8)
+        {
+            *pos++ = (char)(bits & 0xff);
+            bits >>= 8;
         }
-        else
+    }
+    if (bits_num > 0)
+    {
+        *pos++ = (char)bits;
+    }
+    unsigned int last_id = 0;
+    if (leaf)
+    {
+        for (unsigned int i = 0; i < page.keys_num; i++)
+        {
+            put_varint(pos, zigzag(page.pointers[i].page_id - last_id));
+            put_varint(pos, page.pointers[i].offset);
+            last_id = page.pointers[i].page_id;
+        }
+        return;
+    }
+    for (unsigned int i = 0; i <= page.keys_num; i++)
+    {
+        put_varint(pos, zigzag(page.children_id[i] - last_id));
+        last_id = page.children_id[i];
+    }
+}
+
+void get_compressed_keys(const char*& pos, B_tree_page& page, bool leaf)
+{
+    Key first = Key_traits<Key>::get(pos, sizeof(unsigned int));
+    unsigned char width;
+    get_bytes(pos, &width, 1);
+    unsigned long long mask = (1ull << width) - 1;
+    unsigned long long bits = 0;
+    unsigned int bits_num = 0;
+    for (unsigned int i = 0; i < page.keys_num; i++)
+    {
+        for (; bits_num < width; bits_num += 8)
+        {
+            bits |= (unsigned long long)(unsigned char)*pos++ << bits_num;
+        }
+        page.keys[i] = Key_traits<Key>::add(first, (unsigned int)(bits & mask));
+        bits >>= width;
+        bits_num -= width;
+    }
+    fill(page.keys.begin() + page.keys_num, page.keys.end(), no_key);
+    fill(page.pointers.begin(), page.pointers.end(), Record_pointer{UINT_MAX, UINT_MAX});
+    fill(page.children_id.begin(), page.children_id.end(), UINT_MAX);
+    unsigned int last_id = 0;
+    if (leaf)
+    {
+        for (unsigned int i = 0; i < page.keys_num; i++)
+        {
+            page.pointers[i].page_id = last_id + unzigzag(get_varint(pos));
+            page.pointers[i].offset = get_varint(pos);
+            last_id = page.pointers[i].page_id;
+        }
+        return;
+    }
+    for (unsigned int i = 0; i <= page.keys_num; i++)
+    {
+        page.children_id[i] = last_id + unzigzag(get_varint(pos));
+        last_id = page.children_id[i];
+    }
+}
+
+//keys of a slotted page (described at SLOTTED_HEADER_BYTES) with their record pointers or children
+void put_slotted_keys(char*& pos, const B_tree_page& page, bool leaf)
+{
+    if (leaf && tree_config.clustered)
+    {
+        put_bytes(pos, page.sides.data(), page.keys_num * sizeof(Record::sides));
+    }
+    else if (leaf)
+    {
+        put_bytes(pos, page.pointers.data(), page.keys_num * sizeof(Record_pointer));
+    }
+    else
+    {
+        put_bytes(pos, page.children_id.data(), (page.keys_num + 1) * sizeof(unsigned int));
+    }
+    char* end = page_io_buffer.data() + page_io_buffer.size();
+    for (unsigned int i = 0; i < page.keys_num; i++)
+    {
+        unsigned short length = Key_traits<Key>::bytes(page.keys[i]);
+        end -= length;
+        unsigned short offset = end - page_io_buffer.data();
+        put_bytes(pos, &offset, sizeof(unsigned short));
+        put_bytes(pos, &length, sizeof(unsigned short));
+        char* key_pos = end;
+        Key_traits<Key>::put(key_pos, page.keys[i]);
+    }
+}
+
+bool get_slotted_keys(const char*& pos, B_tree_page& page, bool leaf)
+{
+    fill(page.pointers.begin(), page.pointers.end(), Record_pointer{UINT_MAX, UINT_MAX});
+    fill(page.children_id.begin(), page.children_id.end(), UINT_MAX);
+    if (leaf && tree_config.clustered)
+    {
+        get_bytes(pos, page.sides.data(), page.keys_num * sizeof(Record::sides));
+    }
+    else if (leaf)
+    {
+        get_bytes(pos, page.pointers.data(), page.keys_num * sizeof(Record_pointer));
+    }
+    else
+    {
+        get_bytes(pos, page.children_id.data(), (page.keys_num + 1) * sizeof(unsigned int));
+    }
+    for (unsigned int i = 0; i < page.keys_num; i++)
+    {
+        unsigned short offset, length;
+        get_bytes(pos, &offset, sizeof(unsigned short));
+        get_bytes(pos, &length, sizeof(unsigned short));
+        if (offset + length > page_io_buffer.size())
         {
-            init_B_tree_page(parent);
-            parent->keys[0] = keys[med];
-            keys[med] = {UINT_MAX,  UINT_MAX, UINT_MAX};
-            parent_id = parent->id;
-            new_page->parent_id = parent->id;
-            parent->children_id[0] = id;
-            parent->children_id[1] = new_page->id;
-            parent->keys_num = 1;
-            parent->dirty = true;
+            return false;
         }
-        write_index_page(parent->id, *parent, INDEX_DAT_FILENAME);
-        write_index_page(new_page->id, *new_page, INDEX_DAT_FILENAME);
-        parent->pin_count--;
+        const char* key_pos = page_io_buffer.data() + offset;
+        page.keys[i] = Key_traits<Key>::get(key_pos, length);
+    }
+    fill(page.keys.begin() + page.keys_num, page.keys.end(), no_key);
+    return true;
+}
 
+bool load_index_page(Page_file* file, unsigned int page_id, B_tree_page& page)
+{
+    page_io_buffer.resize(tree_config.index_page_size);
+    if (!read_page_image(file, page_id, tree_config.index_page_size))
+    {
+        return false;
     }
-    void insert(B_tree_record rec)
+    return decode_index_page(page_id, page);
+}
+
+//page from its image in page_io_buffer
+bool decode_index_page(unsigned int page_id, B_tree_page& page)
+{
+    page.init_storage();
+    const char* pos = page_io_buffer.data();
+    get_bytes(pos, &page.id, sizeof(unsigned int));
+    get_bytes(pos, &page.keys_num, sizeof(unsigned int));
+    get_bytes(pos, &page.next_free, sizeof(unsigned int));
+    page.prev_leaf = UINT_MAX;
+    page.next_leaf = UINT_MAX;
+    if (!tree_config.bplus_tree)
     {
-        dirty = true;
-        int i = 0;
-        while(i<keys_num && rec.key > keys[i].key)
-        {
-            i++;
-        }
-        for(int j = keys_num; j>i; j--)
+        get_bytes(pos, page.keys.data(), (tree_config.max_keys + 1) * sizeof(Key));
+        get_bytes(pos, page.pointers.data(), (tree_config.max_keys + 1) * sizeof(Record_pointer));
+        get_bytes(pos, page.children_id.data(), (tree_config.max_keys + 2) * sizeof(unsigned int));
+        return true;
+    }
+    unsigned int leaf;
+    get_bytes(pos, &page.prev_leaf, sizeof(unsigned int));
+    get_bytes(pos, &page.next_leaf, sizeof(unsigned int));
+    get_bytes(pos, &leaf, sizeof(unsigned int));
+    if (tree_config.sized_pages)
+    {
+        if (page.keys_num >= page.keys.size())
         {
-            keys[j] = keys[j-1];    //moving records to the right side
+            cerr << "Error: Index page " << page_id << " is damaged" << endl;
+            return false;
         }
-        if(!is_leaf())
+        if (tree_config.compressed_pages)
         {
-            for(int j = keys_num+1; j>i+1; j--)
-            {
-                children_id[j] = children_id[j-1];    //moving children to the right side
-            }
+            get_compressed_keys(pos, page, leaf != 0);
         }
-        keys[i] = rec;          //inserting new page
-        keys_num++;
-
-        //overflow
-        if(keys_num > MAX_KEYS)
+        else if (!get_slotted_keys(pos, page, leaf != 0))
         {
-            unsigned int free_sibling_id = compensation_possible();
-            if(free_sibling_id != UINT_MAX)
-            {
-                compensate(free_sibling_id);
-            }
-            else
-            {
-                pin_count++;
-                split();
-                pin_count--;
-            }
+            cerr << "Error: Index page " << page_id << " is damaged" << endl;
+            return false;
         }
+        return true;
     }
-
-    void merge(const string& filename)
+    if (leaf)
     {
-        B_tree_page* parent = get_index_page(parent_id, filename);
-
-        unsigned int sibling_id;
-
-        //find position in children[] array
-        int i = 0;
-        while(i <= parent->keys_num && parent->children_id[i] != id)
-        {
-            i++;
-        }
-
-        //deciding whether we're taking left or right sibling
-        B_tree_page* sibling;
-        B_tree_page* left;
-        B_tree_page* right;
-        unsigned int left_child_id;     //IN PARENT->CHILDREN_ID, NOT PAGE ID
-        if(i<parent->keys_num)      //we take right sibling by default
+        get_bytes(pos, page.keys.data(), (tree_config.max_keys + 1) * sizeof(Key));
+        if (tree_config.clustered)
         {
-            sibling_id = i+1;
-            sibling = get_index_page(parent->children_id[sibling_id], filename);
-            left = this;
-            right = sibling;
-            left_child_id = sibling_id-1;
+            fill(page.pointers.begin(), page.pointers.end(), Record_pointer{UINT_MAX, UINT_MAX});
+            get_bytes(pos, page.sides.data(), (tree_config.max_keys + 1) * sizeof(Record::sides));
         }
         else
         {
-            sibling_id = i-1;
-            sibling = get_index_page(parent->children_id[sibling_id], filename);
-            left = sibling;
-            right = this;
-            left_child_id = sibling_id;
+            get_bytes(pos, page.pointers.data(), (tree_config.max_keys + 1) * sizeof(Record_pointer));
         }
+        fill(page.children_id.begin(), page.children_id.end(), UINT_MAX);
+        return true;
+    }
+    get_bytes(pos, page.keys.data(), (tree_config.max_interior_keys + 1) * sizeof(Key));
+    fill(page.pointers.begin(), page.pointers.end(), Record_pointer{UINT_MAX, UINT_MAX});
+    get_bytes(pos, page.children_id.data(), (tree_config.max_interior_keys + 2) * sizeof(unsigned int));
+    return true;
+}
 
-        //moving all records to the left sibling
-        left->keys[left->keys_num] = parent->keys[left_child_id]; //moving the parent's record
-        left->keys_num++;
-        parent->keys_num--;
-        for(int i = left_child_id; i<parent->keys_num; i++)
+void store_index_page(Page_file* file, unsigned int page_id, const B_tree_page& page)
+{
+    page_io_buffer.assign(tree_config.index_page_size, 0);
+    char* pos = page_io_buffer.data();
+    put_bytes(pos, &page.id, sizeof(unsigned int));
+    put_bytes(pos, &page.keys_num, sizeof(unsigned int));
+    put_bytes(pos, &page.next_free, sizeof(unsigned int));
+    if (!tree_config.bplus_tree)
+    {
+        put_bytes(pos, page.keys.data(), (tree_config.max_keys + 1) * sizeof(Key));
+        put_bytes(pos, page.pointers.data(), (tree_config.max_keys + 1) * sizeof(Record_pointer));
+        put_bytes(pos, page.children_id.data(), (tree_config.max_keys + 2) * sizeof(unsigned int));
+    }
+    else
+    {
+        unsigned int leaf = page.children_id[0] == UINT_MAX ? 1 : 0;
+        put_bytes(pos, &page.prev_leaf, sizeof(unsigned int));
+        put_bytes(pos, &page.next_leaf, sizeof(unsigned int));
+        put_bytes(pos, &leaf, sizeof(unsigned int));
+        if (tree_config.sized_pages && page.encoded_size() > tree_config.index_page_size)
         {
-            parent->keys[i] = parent->keys[i+1];
-            parent->children_id[i+1] = parent->children_id[i+2];
+            cerr << "Error: Index page " << page_id << " doesn't fit in " << tree_config.index_page_size << " bytes" << endl;      //shouldn't happen
+            return;
         }
-        parent->keys[keys_num] = {UINT_MAX, UINT_MAX, UINT_MAX};
-        parent->children_id[keys_num+1] = UINT_MAX;
-
-        for(int i = 0; i < right->keys_num; i++)
+        if (tree_config.compressed_pages)
         {
-            left->keys[left->keys_num] = right->keys[i];
-            left->keys_num++;
-            right->keys[i] = {UINT_MAX, UINT_MAX, UINT_MAX};
+            put_compressed_keys(pos, page, leaf != 0);
         }
-        right->keys_num = 0;
-        free_index_page(right->id);
-        
-        sibling->pin_count--;
-
-        if(parent->is_underflown())
+        else if (tree_config.sized_pages)
+        {
+            put_slotted_keys(pos, page, leaf != 0);
+        }
+        else if (leaf)
         {
-            if(parent->is_root())
+            put_bytes(pos, page.keys.data(), (tree_config.max_keys + 1) * sizeof(Key));
+            if (tree_config.clustered)
             {
-                for(int i = 0; i<=MIN_KEYS; i++)
-                {
-                    //sign children from right to left sibling!
-                    left->children_id[MIN_KEYS+i] = right->children_id[i];      //it will always be MIN_KEYS + i, otherwise merge wouldn't be called 
-                }
-                free_index_page(parent->id);
-                parent->parent_id = 0;          //so that it won't be seen as a root anymore
-                left->parent_id = UINT_MAX;     //new root
+                put_bytes(pos, page.sides.data(), (tree_config.max_keys + 1) * sizeof(Record::sides));
             }
             else
             {
-                unsigned int sibling_id = parent->compensation_possible();
-                if(sibling_id != UINT_MAX)
-                {
-                    parent->compensate(sibling_id);
-                }
-                else
-                {
-                    parent->merge(filename);
-                }
+                put_bytes(pos, page.pointers.data(), (tree_config.max_keys + 1) * sizeof(Record_pointer));
             }
         }
+        else
+        {
+            put_bytes(pos, page.keys.data(), (tree_config.max_interior_keys + 1) * sizeof(Key));
+            put_bytes(pos, page.children_id.data(), (tree_config.max_interior_keys + 2) * sizeof(unsigned int));
+        }
+    }
+    write_page_image(file, page_id, tree_config.index_page_size);
+}
 
-        parent->pin_count--;
+//record takes record_bytes() - variable-length key is put after its length and followed by zeros
+void put_record(char*& pos, const Record& record)
+{
+    char* end = pos + record_bytes();
+    if (!Key_traits<Key>::fixed_size)
+    {
+        *pos++ = (char)Key_traits<Key>::bytes(record.key);
     }
-};
+    Key_traits<Key>::put(pos, record.key);
+    memset(pos, 0, end - sizeof(Record::sides) - pos);
+    pos = end - sizeof(Record::sides);
+    put_bytes(pos, record.sides, sizeof(Record::sides));
+}
 
-struct B_tree
+void get_record(const char*& pos, Record& record)
 {
-    unsigned int root;
-    string index_dat_filename;
-    string data_dat_filename;
+    const char* end = pos + record_bytes();
+    unsigned int length = Key_traits<Key>::fixed_size ? sizeof(Key) : min((unsigned int)(unsigned char)*pos++, Key_traits<Key>::max_bytes());
+    record.key = Key_traits<Key>::get(pos, length);
+    pos = end - sizeof(Record::sides);
+    get_bytes(pos, record.sides, sizeof(Record::sides));
+}
 
-    bool is_empty()
+bool load_data_page(Page_file* file, unsigned int page_id, Data_page& page)
+{
+    page_io_buffer.resize(tree_config.data_page_size);
+    if (!read_page_image(file, page_id, tree_config.data_page_size))
     {
-        return root == UINT_MAX;
+        return false;
     }
+    decode_data_page(page);
+    return true;
+}
 
-    void print()
+//page from its image in page_io_buffer
+void decode_data_page(Data_page& page)
+{
+    page.init_storage();
+    const char* pos = page_io_buffer.data();
+    get_bytes(pos, &page.id, sizeof(unsigned int));
+    get_bytes(pos, &page.rec_num, sizeof(unsigned int));
+    for (Record& record : page.records)
     {
-        if(!is_empty())
-        {
-            cout<<"Printing B-tree from "<<index_dat_filename<<" file"<<endl;
-            unsigned int disk_reads_before = read_count_data + read_count_index;
-            unsigned int disk_writes_before = write_count_data + write_count_index;
-            B_tree_page* root_page = get_index_page(root, index_dat_filename);
-            root_page->print(1, 1);
-            root_page->pin_count--;
-            //cout<<"Disk reads performed: "<<read_count_data + read_count_index - disk_reads_before<<endl;
-            //cout<<"Disk writes performed: "<<write_count_data + write_count_index - disk_writes_before<<endl;
-        }
-        else
-        {
-            cout<<"Error: Can't print B-tree: B-tree is empty"<<endl;
-        }
-        cout<<endl;
+        get_record(pos, record);
+    }
+    fill(page.free_slots.begin(), page.free_slots.end(), 0);
+    get_bytes(pos, page.free_slots.data(), (tree_config.data_page_records + 7) / 8);
+    if (tree_config.data_page_records % 64 != 0)
+    {
+        page.free_slots.back() &= (1ull << (tree_config.data_page_records % 64)) - 1;
     }
+}
 
-    pair<B_tree_page*, unsigned int> search_for(unsigned int key)
+void store_data_page(Page_file* file, unsigned int page_id, const Data_page& page)
+{
+    page_io_buffer.resize(tree_config.data_page_size);
+    char* pos = page_io_buffer.data();
+    put_bytes(pos, &page.id, sizeof(unsigned int));
+    put_bytes(pos, &page.rec_num, sizeof(unsigned int));
+    for (const Record& record : page.records)
     {
-        if (is_empty())
-        {
-            return {nullptr, UINT_MAX};      //not found
-        }
+        put_record(pos, record);
+    }
+    put_bytes(pos, page.free_slots.data(), (tree_config.data_page_records + 7) / 8);
+    write_page_image(file, page_id, tree_config.data_page_size);
+}
 
-        unsigned int disk_reads_before = read_count_data + read_count_index;
-        unsigned int disk_writes_before = write_count_data + write_count_index;
+unordered_map<string, unique_ptr<Page_file>> page_files;     //files stay open for the whole run
+mutex page_files_latch;
+
+Page_file* get_page_file(const string& filename)
+{
+    lock_guard<mutex> lock(page_files_latch);
+    unordered_map<string, unique_ptr<Page_file>>::iterator it = page_files.find(filename);
+    if (it != page_files.end())
+    {
+        return it->second.get();
+    }
+    unique_ptr<Page_file> file = make_unique<Page_file>();
+    if (!file->open_file(filename))
+    {
+        return nullptr;
+    }
+    Page_file* file_p = file.get();
+    page_files[filename] = move(file);
+    return file_p;
+}
 
-        unsigned int current_page_id = root;
+void close_all_page_files()
+{
+    for (auto& [filename, file] : page_files)
+    {
+        file->close_file();
+    }
+    page_files.clear();
+}
 
-        B_tree_page* current_page;
+//returns pinned page, latched if an operation is in progress (see latch_index_page())
+B_tree_page* get_index_page(unsigned int page_id, const string& filename)
+{
+    if (page_id == UINT_MAX)
+    {
+        cerr<<"Error: Tried to get index page number UINT_MAX"<<endl;
+        return nullptr;
+    }
+    B_tree_page* page = pin_index_page(page_id, filename);
+    if (page)
+    {
+        latch_index_page(page);
+    }
+    return page;
+}
 
-        while(true)
-        {
-            current_page = get_index_page(current_page_id, index_dat_filename);
+B_tree_page* pin_index_page(unsigned int page_id, const string& filename)
+{
+    lock_guard<mutex> lock(index_buffer.latch(page_id));
 
-            int result = current_page->bisection_search(key);
-            if(result != -1)            //found on current page
-            {
-                current_page->pin_count--;
-                return {current_page, result};
-            }
-            if(current_page->is_leaf())
-            {
-                current_page->pin_count--;
-                return {current_page, UINT_MAX};      //not found
-            }
+    //page in RAM - don't read it from disk
+    B_tree_page* page = index_buffer.find(page_id);
+    if (page)
+    {
+        return page;
+    }
+    //page not in RAM - read it from disk
+    Page_file* index = get_page_file(filename);
+    if (!index)
+    {
+        return nullptr;
+    }
 
-            if(key < current_page->keys[0].key)
-            {
-                current_page->pin_count--;
-                current_page_id = current_page->children_id[0];
-                continue;
-            }
-            else if (key > current_page->keys[current_page->keys_num-1].key)
+    page = index_buffer.add(page_id, filename);
+    if (!page)
+    {
+        cerr<<"Error: Index pages buffer is too small to handle operation (all pages are being used). Try setting higher INDEX_BUFFER_LIMIT."<<endl;
+        return nullptr;
+    }
+    page->version.begin_change();       //optimistic reads of the page the frame held see it's gone
+    bool loaded = load_index_page(index, page_id, *page);
+    page->version.end_change();
+    if (!loaded)
+    {
+        cerr << "Error: Couldn't read index page " << page_id << endl;
+        index_buffer.remove(page_id);
+        return nullptr;
+    }
+
+    read_count_index++;
+    page->dirty = false;
+    page->pin_count = 1;        //value saved on disk is meaningless
+    return page;
+}
+
+//page in the buffer, neither pinned nor latched - for optimistic reads only (see B_tree::search_optimistic())
+B_tree_page* peek_index_page(unsigned int page_id)
+{
+    return index_buffer.peek(page_id);
+}
+
+//pinned page if it's in the buffer, nullptr otherwise - nothing is read from disk (released with release_index_page())
+B_tree_page* find_index_page(unsigned int page_id)
+{
+    B_tree_page* page;
+    {
+        lock_guard<mutex> lock(index_buffer.latch(page_id));
+        page = index_buffer.find(page_id);
+    }
+    if (page)
+    {
+        latch_index_page(page);
+    }
+    return page;
+}
+
+//READ-AHEAD: pages an operation will need, read together (see Io_engine) and left in the buffer unpinned
+//the ones that don't fit (or are evicted before they're used) are read again when they're needed
+
+//images of the pages that aren't in the buffer - the log keeps the newest images of some of them
+template <typename Page>
+vector<Io_request> read_page_images(Page_file* file, const vector<unsigned int>& page_ids, unsigned int page_size, Page_buffer<Page>& buffer)
+{
+    vector<Io_request> requests;
+    for (unsigned int page_id : page_ids)
+    {
+        {
+            lock_guard<mutex> lock(buffer.latch(page_id));
+            if (buffer.contains(page_id))
             {
-                current_page->pin_count--;
-                current_page_id = current_page->children_id[current_page->keys_num];
                 continue;
             }
-            for(int i = 1; i<current_page->keys_num; i++)
-            {
-                if(key<current_page->keys[i].key)
-                {
-                    current_page->pin_count--;
-                    current_page_id = current_page->children_id[i];
-                    break;
-                }
-            }
+            requests.push_back({file, page_id, vector<char>(page_size)});
+            requests.back().ticket = buffer.shard(page_id).start_reading(page_id);
         }
-
-        //shouldn't ever happen
-        return {nullptr, UINT_MAX};
+        requests.back().read = wal.find_image(file, page_id, requests.back().image.data(), page_size);
     }
+    io_engine.read_pages(requests);
+    return requests;
+}
 
-    void insert(B_tree_record new_B_rec)
+//returns how many pages were read
+unsigned int read_ahead_index_pages(const vector<unsigned int>& page_ids, const string& filename)
+{
+    Page_file* index = get_page_file(filename);
+    if (!index)
     {
-        cout<<"\n\nInserting record with key "<<new_B_rec.key<<endl;
-        
-        unsigned int disk_reads_before = read_count_data + read_count_index;
-        unsigned int disk_writes_before = write_count_data + write_count_index;
-
-        pair<B_tree_page*, unsigned int> result = search_for(new_B_rec.key);
-        B_tree_page* current_page = result.first;
-        unsigned int pos = result.second;
+        return 0;
+    }
+    vector<Io_request> requests = read_page_images(index, page_ids, tree_config.index_page_size, index_buffer);
+    unsigned int loaded = 0;
+    for (Io_request& request : requests)
+    {
+        lock_guard<mutex> lock(index_buffer.latch(request.page_id));
+        //another operation could have loaded the page meanwhile (and changed and evicted it since)
+        bool newest = index_buffer.shard(request.page_id).end_reading(request.page_id, request.ticket);
+        if (!request.read || !newest)
+        {
+            continue;
+        }
+        B_tree_page* page = index_buffer.add(request.page_id, filename);
+        if (!page)
+        {
+            continue;       //all the pages of the shard are pinned
+        }
+        page_io_buffer.swap(request.image);
+        page->version.begin_change();
+        bool decoded = decode_index_page(request.page_id, *page);
+        page->version.end_change();
+        if (!decoded)
+        {
+            index_buffer.remove(request.page_id);
+            continue;
+        }
+        read_count_index++;
+        page->dirty = false;
+        page->pin_count = 0;
+        loaded++;
+    }
+    return loaded;
+}
 
-        if (pos != UINT_MAX)
+//the caller holds data_latch
+unsigned int read_ahead_data_pages(const vector<unsigned int>& page_ids, const string& filename)
+{
+    Page_file* data = get_page_file(filename);
+    if (!data)
+    {
+        return 0;
+    }
+    vector<Io_request> requests = read_page_images(data, page_ids, tree_config.data_page_size, data_buffer);
+    unsigned int loaded = 0;
+    for (Io_request& request : requests)
+    {
+        data_buffer.shard(request.page_id).end_reading(request.page_id, request.ticket);        //nothing is added meanwhile under data_latch
+        if (!request.read || data_buffer.contains(request.page_id))
         {
-            cout<<"Error: Couldn't insert record. Record with key "<<new_B_rec.key<<" already exists in the B-tree."<<endl;
-            cout<<"Disk reads performed: "<<read_count_data + read_count_index - disk_reads_before<<endl;
-            cout<<"Disk writes performed: "<<write_count_data + write_count_index - disk_writes_before<<endl;
-            return;
+            continue;
         }
+        Data_page* page = data_buffer.add(request.page_id, filename);
+        if (!page)
+        {
+            break;
+        }
+        page_io_buffer.swap(request.image);
+        decode_data_page(*page);
+        read_count_data++;
+        page->dirty = false;
+        page->pin_count = 0;
+        loaded++;
+    }
+    return loaded;
+}
+
+void write_index_page(unsigned int page_id, B_tree_page& page, const string& filename)
+{
+    Page_file* index = get_page_file(filename);
+    if (!index)
+    {
+        return;
+    }
 
-        current_page->pin_count++;
-        current_page->insert(new_B_rec);
-        current_page->pin_count--;
+    page.dirty = false;
+    store_index_page(index, page_id, page);
+
+    write_count_index++;
+}
 
-        B_tree_page* root_p = get_index_page(root, index_dat_filename);
-        if(!root_p->is_root())
+//dirty pages are written together once all of them are saved, adjacent ones with a single write (see Write_batch)
+void flush_index_buffer(const string& filename)         //saves to the file if dirty=true
+{
+    vector<unique_lock<mutex>> locks = index_buffer.latch_all();       //no page is evicted (and saved) before its batch is written
+    Write_batch batch;
+    write_batch = &batch;
+    index_buffer.for_each_page([&filename](unsigned int page_id, B_tree_page& page)
+    {
+        if (page.dirty)
         {
-            root = root_p->parent_id;
+            write_index_page(page_id, page, filename);
         }
+    });
+    write_batch = nullptr;
+    batch.write();
+}
 
-        root_p->pin_count--;
+Data_page* get_data_page(unsigned int page_id, const string& filename)
+{
+    //page in RAM - don't read it from disk
+    Data_page* page = data_buffer.find(page_id);
+    if (page)
+    {
+        return page;
+    }
 
-        cout<<"Disk reads performed: "<<read_count_data + read_count_index - disk_reads_before<<endl;
-        cout<<"Disk writes performed: "<<write_count_data + write_count_index - disk_writes_before<<endl;
-        cout<<endl;
+    Page_file* data = get_page_file(filename);
+    if (!data)
+    {
+        return nullptr;
+    }
 
-        if(PRINT_FILES)
-        {
-            print_data_dat(data_dat_filename);
-            print();
-        }
+    page = data_buffer.add(page_id, filename);
+    if (!page)
+    {
+        cerr<<"Error: Data pages buffer is too small to handle operation (all pages are being used). Try setting higher DATA_BUFFER_LIMIT."<<endl;
+        return nullptr;
+    }
+    if (!load_data_page(data, page_id, *page))
+    {
+        cerr << "Error: Couldn't read data page " << page_id << endl;
+        data_buffer.remove(page_id);
+        return nullptr;
     }
 
-    Record read_record(unsigned int key)
+    read_count_data++;
+    page->dirty = false;
+    page->pin_count = 1;
+    return page;
+}
+
+void write_data_page(unsigned int page_id, Data_page& page, const string& filename)
+{
+    Page_file* data = get_page_file(filename);
+    if (!data)
     {
-        cout<<"\n\nReading record with key "<<key<<endl;
-        
-        unsigned int disk_reads_before = read_count_data + read_count_index;
-        unsigned int disk_writes_before = write_count_data + write_count_index;
+        return;
+    }
 
-        pair<B_tree_page*, unsigned int> result = search_for(key);
-        B_tree_page* current_page = result.first;
-        unsigned int pos = result.second;
+    page.dirty = false;
+    store_data_page(data, page_id, page);
 
-        if(pos == UINT_MAX)     //not found
-        {
-            cout<<"Error: Couldn't read record. Key "<<key<<" does not exist in the B-tree."<<endl;
-            cout<<"Disk reads performed: "<<read_count_data + read_count_index - disk_reads_before<<endl;
-            cout<<"Disk writes performed: "<<write_count_data + write_count_index - disk_writes_before<<endl;
-            return {UINT_MAX, {UINT_MAX, UINT_MAX, UINT_MAX, UINT_MAX, UINT_MAX}};
-        }
-        Data_page* dpage = get_data_page(current_page->keys[pos].page_id, data_dat_filename);
-        if (!dpage)
-        {
-            cerr << "Error: couldn't load data page\n";
-            return {UINT_MAX, {UINT_MAX, UINT_MAX, UINT_MAX, UINT_MAX, UINT_MAX}};
-        }
+    write_count_data++;
+}
 
-        if (current_page->keys[pos].offset >= DATA_PAGE_SIZE)
-        {
-            cerr << "Error: offset out of range\n";
-            return {UINT_MAX, {UINT_MAX, UINT_MAX, UINT_MAX, UINT_MAX, UINT_MAX}};
-        }
+void print_data_dat(const string &filename)
+{
+    flush_all_buffers(DATA_DAT_FILENAME, INDEX_DAT_FILENAME);
+    Page_file* data = get_page_file(filename);
+    if(!data)
+    {
+        return;
+    }
 
-        if (dpage->slot_free[current_page->keys[pos].offset])
-        {
-            cerr << "Error: slot is marked as free, inconsistent state\n";
-            return {UINT_MAX, {UINT_MAX, UINT_MAX, UINT_MAX, UINT_MAX, UINT_MAX}};
-        }
+    cout<<"Contents of the "<<filename<<" file\n"<<endl;
 
-        Record r = dpage->records[current_page->keys[pos].offset];
+    Data_page current_page;
+    unsigned int current_id = 0;
 
-        cout << "Loaded record key = " << r.key << endl;
-        for (int i = 0; i < 5; i++)
+    while(true)
+    {
+        if(!load_data_page(data, current_id, current_page))
         {
-            cout << r.sides[i] << " ";
+            break;      //eof
         }
-        cout << endl;
-
-        cout<<"Disk reads performed: "<<read_count_data + read_count_index - disk_reads_before<<endl;
-        cout<<"Disk writes performed: "<<write_count_data + write_count_index - disk_writes_before<<endl;
-        cout<<endl;
 
-        return {r.key, {r.sides[0], r.sides[1], r.sides[2], r.sides[3], r.sides[4]}};
-    }
-
-    void update_record(Record rec)
-    {
-        cout<<"\n\nUpdating record with key "<<rec.key<<" to ";
-        for(int i = 0; i<5; i++)
+        cout<<"Data page ["<<current_page.id<<"]:"<<endl;
+        cout<<"dirty = "<<current_page.dirty<<endl;
+        cout<<"rec_num = "<<current_page.rec_num<<endl;
+        cout<<"Records:"<<endl;
+        for(int i = 0; i<tree_config.data_page_records; i++)
         {
-            cout<<rec.sides[i]<<" ";
+            cout<<i<<": ";
+            if(current_page.slot_free(i))
+            {
+                cout<<"free slot"<<endl;
+            }
+            else
+            {
+                cout<<"Key: "<<current_page.records[i].key<<" Sides:";
+                for(int j = 0; j<5; j++)
+                {
+                    cout<<" "<<current_page.records[i].sides[j];
+                }
+                cout<<endl;
+            }
         }
         cout<<endl;
 
-        unsigned int disk_reads_before = read_count_data + read_count_index;
-        unsigned int disk_writes_before = write_count_data + write_count_index;
-
-        pair<B_tree_page*, unsigned int> result = search_for(rec.key);
-        B_tree_page* page = result.first;
-        unsigned int pos = result.second;
-        B_tree_record rec_to_change = page->keys[pos];
+        current_id++;
+    }
+}
 
-        if(pos == UINT_MAX)     //not in the tree
+void flush_data_buffer(const string& filename)      //modifies dirty data pages
+{
+    lock_guard<mutex> lock(data_latch);
+    Write_batch batch;
+    write_batch = &batch;
+    data_buffer.for_each_page([&filename](unsigned int page_id, Data_page& page)
+    {
+        if (page.dirty)
         {
-            cout<<"Error: Couldn't update record. Record with key "<<rec.key<<" does not exist in the B-tree."<<endl;
-            cout<<"Disk reads performed: "<<read_count_data + read_count_index - disk_reads_before<<endl;
-            cout<<"Disk writes performed: "<<write_count_data + write_count_index - disk_writes_before<<endl;
-            return;
+            write_data_page(page_id, page, filename);
         }
+    });
+    write_batch = nullptr;
+    batch.write();
+}
 
-        update_rec_in_data_dat(rec_to_change, rec);
-
-
-        cout<<"Disk reads performed: "<<read_count_data + read_count_index - disk_reads_before<<endl;
-        cout<<"Disk writes performed: "<<write_count_data + write_count_index - disk_writes_before<<endl;
-        cout<<endl;
+void remove_rec_from_data_dat(B_tree_record rec)
+{
+    lock_guard<mutex> lock(data_latch);
+    Data_page* dpage = get_data_page(rec.page_id, DATA_DAT_FILENAME);
+    if(!dpage)
+    {
+        return;
+    }
+    dpage->set_slot_free(rec.offset, true);
+    dpage->dirty = true;
+    dpage->rec_num--;
+    free_space_map.set(dpage->id, true);
+    dpage->pin_count--;
+    data_records--;
+}
 
-        if(PRINT_FILES)
-        {
-            print_data_dat(data_dat_filename);
-            print();
-        }
-    
+//cuts off pages of the file from pages_num on - changes are saved before the file shrinks, with the log on it's emptied too,
+//so that redoing it can't write pages past the new end
+void cut_page_file(B_tree* tree, Page_file* file, unsigned int pages_num, size_t page_size)
+{
+    if (wal.logging)
+    {
+        wal.commit(tree->root);
+        wal.flush();
+        save_tree_meta(tree->root, true);
+        wal.checkpoint();
+    }
+    else
+    {
+        flush_all_buffers(tree->data_dat_filename, tree->index_dat_filename);
+        file->sync_file();
     }
+    file->truncate_pages(pages_num, page_size);
+}
+
+//COMPACTION_FILL_FACTOR: pages of data.dat hold on average less than that part of the records they have room for
+bool data_dat_sparse()
+{
+    return COMPACTION_FILL_FACTOR > 0 && !tree_config.clustered && next_data_page_id > 1
+           && data_records < COMPACTION_FILL_FACTOR * next_data_page_id * tree_config.data_page_records;
+}
 
-    void remove(unsigned int key)
+//moves records from the last data pages to free slots of the first ones until the live records fill as few pages as possible,
+//then the emptied pages are cut off data.dat; index records of the moved ones are corrected afterwards in key order,
+//so that consecutive searches go through the same index pages
+void compact_data_dat(B_tree* tree)
+{
+    cout<<"\n\nCompacting "<<tree->data_dat_filename<<" ("<<data_records<<" records in "<<next_data_page_id<<" pages)"<<endl;
+    if (tree_config.clustered)
     {
-        cout<<"\n\nRemoving record with key "<<key<<endl;
-        
-        unsigned int disk_reads_before = read_count_data + read_count_index;
-        unsigned int disk_writes_before = write_count_data + write_count_index;
+        cout<<"Records are kept in the leaves, "<<tree->data_dat_filename<<" isn't used"<<endl;
+        return;
+    }
 
-        pair<B_tree_page*, unsigned int> result = search_for(key);
-        B_tree_page* page = result.first;
-        unsigned int pos = result.second;
-        B_tree_record rec = page->keys[pos];
+    unsigned int disk_reads_before = read_count_data + read_count_index;
+    unsigned int disk_writes_before = write_count_data + write_count_index;
 
-        if(pos == UINT_MAX)
+    unique_lock<Tree_latch> exclusive(tree->tree_latch);
+    vector<pair<B_tree_record, Record_pointer>> moved;        //keys with their new and old place
+    unsigned int end = next_data_page_id;       //pages from end on are empty
+    while (end > 0)
+    {
+        unsigned int last = end - 1;
+        Data_page* source = get_data_page(last, tree->data_dat_filename);
+        if (!source)
         {
-            cout<<"Error: Couldn't remove record. Record with key "<<key<<" does not exist in the B-tree."<<endl;
-            cout<<"Disk reads performed: "<<read_count_data + read_count_index - disk_reads_before<<endl;
-            cout<<"Disk writes performed: "<<write_count_data + write_count_index - disk_writes_before<<endl;
-            return;
+            break;
         }
-
-        //B_tree_page* page = get_index_page(rec.page_id, index_dat_filename);
-        B_tree_page* page_to_check;
-        remove_rec_from_data_dat(rec);
-
-        if(!page->is_leaf())
+        bool emptied = true;
+        for (int i = 0; i < tree_config.data_page_records && source->rec_num > 0; i++)
         {
-            B_tree_page* child = get_index_page(page->children_id[pos], index_dat_filename);      //left child
-            bool from_left = true;
-            
-            while (!child->is_leaf())
+            if (source->slot_free(i)) continue;
+
+            unsigned int target_id = free_space_map.first();
+            if (target_id == UINT_MAX || target_id >= last)       //no room before this page
             {
-                child->pin_count--;
-                child = get_index_page(child->children_id[child->keys_num], index_dat_filename);        //going to the right side until we reach the leaf
+                emptied = false;
+                break;
             }
-            if(child->keys_num == MIN_KEYS)
+            Data_page* target = get_data_page(target_id, tree->data_dat_filename);
+            if (!target)
             {
-                B_tree_page* predeccesor_page = child;      //remembering predeccesor's position in case exchanging with successor also will result in merge
-                //to prevent underflow nad merging, we're taking from the right side
-                child = get_index_page(page->children_id[pos + 1], index_dat_filename);      //right child
-                 while (!child->is_leaf())
-                {
-                    child->pin_count--;
-                    child = get_index_page(child->children_id[0], index_dat_filename);        //going to the left side until we reach the leaf
-                }
-                if(child->keys_num == MIN_KEYS)
-                {
-                    child->pin_count--;
-                    child = predeccesor_page;       //taking from the left side is prefered
-                }
-                else
-                {
-                    from_left = false;
-                    predeccesor_page->pin_count--;
-                }
+                emptied = false;
+                break;
             }
-            if(from_left)
+            unsigned int slot = target->first_free_slot();
+            if (slot == UINT_MAX)
             {
-                page->keys[pos] = child->keys[child->keys_num-1];        //taking the maximum value
-                child->keys[child->keys_num-1] = {UINT_MAX, UINT_MAX, UINT_MAX};     //clearing spot
+                cerr << "Error: Data page " << target_id << " has no free slot, inconsistent free-space map" << endl;
+                free_space_map.set(target_id, false);
+                target->pin_count--;
+                i--;        //another page is tried
+                continue;
             }
-            else
+            target->records[slot] = source->records[i];
+            target->set_slot_free(slot, false);
+            target->rec_num++;
+            target->dirty = true;
+            if (target->first_free_slot() == UINT_MAX)
             {
-                page->keys[pos] = child->keys[0];       //taking the minimum value
-                for(int i = 0; i<child->keys_num-1; i++)
-                {
-                    child->keys[i] = child->keys[i+1];
-                }
-                child->keys[child->keys_num-1] = {UINT_MAX, UINT_MAX, UINT_MAX};
+                free_space_map.set(target_id, false);
             }
-            child->keys_num--;
-            page_to_check = child;
+            target->pin_count--;
+
+            source->set_slot_free(i, true);
+            source->rec_num--;
+            source->dirty = true;
+            moved.push_back({{source->records[i].key, target_id, slot}, {last, (unsigned int)i}});
         }
-        else
+        if (!emptied)
         {
-            for(int j = pos; j <page->keys_num-1; j++)
-            {
-                page->keys[j] = page->keys[j+1];
-            }
-            page->keys[page->keys_num - 1] = {UINT_MAX, UINT_MAX, UINT_MAX};
-            page->keys_num--;
-            page_to_check = page;
+            free_space_map.set(last, source->first_free_slot() != UINT_MAX);
+            source->pin_count--;
+            break;
         }
+        source->pin_count--;
+        data_buffer.remove(last);       //page is cut off, it isn't saved
+        free_space_map.set(last, false);
+        end--;
+    }
+    unsigned int freed_pages = next_data_page_id - end;
+    next_data_page_id = end;
 
-        if(page_to_check->is_underflown())
+    sort(moved.begin(), moved.end(), [](const pair<B_tree_record, Record_pointer>& a, const pair<B_tree_record, Record_pointer>& b)
+    {
+        return key_less(a.first.key, b.first.key);
+    });
+    for (unsigned int i = 0; i < moved.size(); i++)
+    {
+        const B_tree_record& to = moved[i].first;
+        const Record_pointer& from = moved[i].second;
+        pair<B_tree_page*, unsigned int> result = tree->search_for(to.key, &tree->path);
+        B_tree_page* page = result.first;
+        unsigned int pos = result.second;
+        if (pos == UINT_MAX)
         {
-            unsigned int sibling_id = page_to_check->compensation_possible();
-            if(sibling_id != UINT_MAX)
-            {
-                page_to_check->compensate(sibling_id);
-            }
-            else
+            if (page)
             {
-                page_to_check->merge(index_dat_filename);
+                release_index_page(page);
             }
+            cerr << "Error: Moved record with key " << to.key << " isn't in the B-tree" << endl;
+            continue;
         }
-
-        page_to_check->pin_count--;
-
-        B_tree_page* root_p = get_index_page(root, index_dat_filename);
-
-        if(!root_p->is_root())
+        if (page->pointers[pos].page_id != from.page_id || page->pointers[pos].offset != from.offset)
         {
-            root = root_p->children_id[0];
+            release_index_page(page);      //the key points at another record, this one wasn't in the tree
+            continue;
         }
-
-        cout<<"Disk reads performed: "<<read_count_data + read_count_index - disk_reads_before<<endl;
-        cout<<"Disk writes performed: "<<write_count_data + write_count_index - disk_writes_before<<endl;
-        cout<<endl;
-
-        if(PRINT_FILES)
+        page->pointers[pos] = {to.page_id, to.offset};
+        page->dirty = true;
+        if (page->is_overflown())       //compressed page - pointers may take more bytes than before
         {
-            print_data_dat(data_dat_filename);
-            print();
+            page->pin_count++;
+            page->split(tree->path, tree->path.steps.size()-1);
+            page->pin_count--;
+            tree->root = tree->path.root;
         }
+        release_index_page(page);
+    }
+
+    Page_file* data = get_page_file(tree->data_dat_filename);
+    if (data)
+    {
+        cut_page_file(tree, data, next_data_page_id, tree_config.data_page_size);
     }
-};
 
+    cout<<moved.size()<<" records moved, "<<freed_pages<<" pages freed"<<endl;
+    cout<<"Disk reads performed: "<<read_count_data + read_count_index - disk_reads_before<<endl;
+    cout<<"Disk writes performed: "<<write_count_data + write_count_index - disk_writes_before<<endl;
+    cout<<endl;
 
-//FUNCTIONS
+    if(PRINT_FILES)
+    {
+        print_data_dat(tree->data_dat_filename);
+        tree->print();
+    }
+}
 
+//DEFRAGMENT_FREE_RATIO: that part of index.dat pages is in the free list
+bool index_dat_sparse()
+{
+    return DEFRAGMENT_FREE_RATIO > 0 && free_index_pages > 0 && free_index_pages >= DEFRAGMENT_FREE_RATIO * next_page_id;
+}
 
-void init_data_page(Data_page *dpage)
+//points the ids kept in the page (its own, children, leaf siblings) at pages renumbered by new_id
+void renumber_index_page(B_tree_page& page, unsigned int old_id, const vector<unsigned int>& new_id)
 {
-    dpage->rec_num = 0;
-    dpage->id = next_data_page_id;
-    dpage->dirty = true;
-    for(int i = 0; i<DATA_PAGE_SIZE; i++)
+    page.id = new_id[old_id];
+    page.next_free = UINT_MAX;
+    if (!page.is_leaf())
+    {
+        for (unsigned int i = 0; i <= page.keys_num; i++)
+        {
+            page.children_id[i] = new_id[page.children_id[i]];
+        }
+    }
+    if (page.prev_leaf != UINT_MAX)
     {
-        dpage->slot_free[i] = true;
-        dpage->records[i] = {dpage->id, {-1, -1, -1, -1, -1}};
+        page.prev_leaf = new_id[page.prev_leaf];
+    }
+    if (page.next_leaf != UINT_MAX)
+    {
+        page.next_leaf = new_id[page.next_leaf];
     }
-    data_pages_with_free_slots.push_back(dpage->id);
-    next_data_page_id++;
-
-    write_data_page(dpage->id, *dpage, DATA_DAT_FILENAME);
 }
 
-//returns id of data page and offset
-pair <unsigned int, unsigned int> insert_rec_in_data_dat(Record rec)
+//renumbers pages of the tree breadth-first from the root (the way bulk loading numbers them), so that the free pages are gone
+//and index.dat is cut right after the live ones
+//upper pages are read to number their children, then pages are moved along cycles of the renumbering, each read and written once
+void defragment_index_dat(B_tree* tree)
 {
-    unsigned int dpage_id;
-    Data_page dpage;
-    Data_page* dpage_p = &dpage;
-    int i = 0;
-    if(!data_pages_with_free_slots.empty())
-    { 
-        dpage_id = data_pages_with_free_slots.front();
-        dpage_p = get_data_page(dpage_id, DATA_DAT_FILENAME);
-        //finding free spot
-        for(i = 0; i<DATA_PAGE_SIZE; i++)
+    cout<<"\n\nDefragmenting "<<tree->index_dat_filename<<" ("<<next_page_id<<" pages, "<<free_index_pages<<" of them free)"<<endl;
+
+    unsigned int disk_reads_before = read_count_data + read_count_index;
+    unsigned int disk_writes_before = write_count_data + write_count_index;
+
+    unique_lock<Tree_latch> exclusive(tree->tree_latch);
+    Page_file* index = get_page_file(tree->index_dat_filename);
+    if (!index)
+    {
+        return;
+    }
+    flush_index_buffer(tree->index_dat_filename);
+    index_buffer.clear();       //pages are moved past the buffer
+
+    vector<unsigned int> order;     //old ids of the pages in the new order
+    vector<unsigned int> new_id(next_page_id, UINT_MAX);
+    if (!tree->is_empty())
+    {
+        order.push_back(tree->root);
+        new_id[tree->root] = 0;
+    }
+    B_tree_page page;
+    unsigned int level_begin = 0;
+    bool leaves = false;
+    while (level_begin < order.size() && !leaves)       //pages of the leaf level aren't read, the first one tells it's there
+    {
+        unsigned int level_end = order.size();
+        for (unsigned int i = level_begin; i < level_end && !leaves; i++)
         {
-            if(dpage_p->slot_free[i])
+            if (!load_index_page(index, order[i], page))
+            {
+                cerr << "Error: Couldn't read index page " << order[i] << ", " << tree->index_dat_filename << " isn't defragmented" << endl;
+                return;
+            }
+            read_count_index++;
+            leaves = page.is_leaf();
+            for (unsigned int c = 0; !leaves && c <= page.keys_num; c++)
+            {
+                unsigned int child = page.children_id[c];
+                if (child >= new_id.size() || new_id[child] != UINT_MAX)
+                {
+                    cerr << "Error: Index page " << order[i] << " has a wrong child " << child << ", " << tree->index_dat_filename << " isn't defragmented" << endl;
+                    return;
+                }
+                new_id[child] = order.size();
+                order.push_back(child);
+            }
+            if (!leaves && tree_config.compressed_pages)
             {
-                break;
+                renumber_index_page(page, order[i], new_id);
+                if (!page.fits())       //varints of the first child may get longer
+                {
+                    cerr << "Error: Index page " << order[i] << " doesn't fit with its children renumbered, " << tree->index_dat_filename << " isn't defragmented" << endl;
+                    return;
+                }
             }
         }
-        //checking if there are any free slots left
-        bool to_delete = true;
-        for (int j = i; j<DATA_PAGE_SIZE; j++)
+        level_begin = level_end;
+    }
+
+    vector<bool> loaded(next_page_id, false);
+    B_tree_page next;
+    unsigned int moved = 0;
+    for (unsigned int i = 0; i < order.size(); i++)
+    {
+        unsigned int old_id = order[i];
+        if (loaded[old_id])
+        {
+            continue;
+        }
+        if (!load_index_page(index, old_id, page))
+        {
+            cerr << "Error: Couldn't read index page " << old_id << endl;
+            return;
+        }
+        read_count_index++;
+        loaded[old_id] = true;
+        while (true)        //page holds the old page old_id, it goes where the page new_id[old_id] is now
         {
-            if(dpage_p->slot_free[j])
+            unsigned int target = new_id[old_id];
+            bool occupied = target < next_page_id && new_id[target] != UINT_MAX && !loaded[target];       //by a page that isn't moved yet
+            if (occupied)
+            {
+                if (!load_index_page(index, target, next))
+                {
+                    cerr << "Error: Couldn't read index page " << target << endl;
+                    return;
+                }
+                read_count_index++;
+                loaded[target] = true;
+            }
+            renumber_index_page(page, old_id, new_id);
+            store_index_page(index, target, page);
+            write_count_index++;
+            moved += target != old_id ? 1 : 0;
+            if (!occupied)
             {
-                to_delete = false;
                 break;
             }
-        }
-        if(to_delete)        //no more free slots left
-        {
-            data_pages_with_free_slots.erase(data_pages_with_free_slots.begin());
+            swap(page, next);
+            old_id = target;
         }
     }
-    else
+    unsigned int freed_pages = next_page_id - order.size();
+    next_page_id = order.size();
+    free_list_head = UINT_MAX;
+    free_index_pages = 0;
+    tree->root = order.empty() ? UINT_MAX : 0;
+    cut_page_file(tree, index, next_page_id, tree_config.index_page_size);
+
+    cout<<moved<<" pages moved, "<<freed_pages<<" pages freed"<<endl;
+    cout<<"Disk reads performed: "<<read_count_data + read_count_index - disk_reads_before<<endl;
+    cout<<"Disk writes performed: "<<write_count_data + write_count_index - disk_writes_before<<endl;
+    cout<<endl;
+
+    if(PRINT_FILES)
     {
-        dpage_id = next_data_page_id;
-        init_data_page(dpage_p);
+        tree->print();
     }
-    dpage_p->records[i] = rec;
-    dpage_p->slot_free[i] = false;
-    dpage_p->dirty = true;
-    dpage_p->rec_num++;
-    return {dpage_id, i};
 }
 
-void process_operations(const string& filename, B_tree* tree)
+bool sides_valid(const Record& rec)
 {
-    ifstream in(filename);
-    if (!in.is_open())
+    for (int i = 0; i < 5; i++)
+    {
+        if(rec.sides[i] <= 0)
+        {
+            cout<<"Error: Record has invalid value. Sides need to be a real number larger than 0."<<endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+void update_rec_in_data_dat (B_tree_record rec_to_change, Record new_rec)
+{
+    if (!sides_valid(new_rec))
     {
-        cerr << "Error: Couldn't open operations file " << filename << endl;
         return;
     }
 
-    string line;
-    while (getline(in, line))
+    lock_guard<mutex> lock(data_latch);
+    Data_page* dpage = get_data_page(rec_to_change.page_id, DATA_DAT_FILENAME);
+    if(!dpage)
     {
-        if (line.empty()) continue;
+        return;
+    }
 
-        // INSERT
-        if (line.rfind("insert(", 0) == 0)
-        {
-            line = line.substr(7, line.size() - 8);
+    for(int i = 0; i<5; i++)
+    {
+        dpage->records[rec_to_change.offset].sides[i] = new_rec.sides[i];
+    }
 
-            stringstream ss(line);
+    dpage->dirty = true;
+    dpage->pin_count--;
+}
 
-            Record r;
-            ss >> r.key;
-            for (int i = 0; i < 5; i++)
-                ss >> r.sides[i];
+void flush_all_buffers(const string& data_dat_filename, const string& index_dat_filename)
+{
+    flush_index_buffer(index_dat_filename);
+    flush_data_buffer(data_dat_filename);
+}
 
-            pair<unsigned int, unsigned int> result = insert_rec_in_data_dat(r);
-            B_tree_record to_insert;
-            to_insert.key = r.key;
-            to_insert.page_id = result.first;
-            to_insert.offset = result.second;
+//PAGE CLEANER
+//saves dirty pages in the background, so that evictions find clean victims and operations don't stop to write them:
+//once more than CLEANER_DIRTY_RATIO of a buffer shard is dirty, its pages are saved until half of that is left, every
+//CLEANER_CHECKPOINT_MS all of them are saved and the files synced - only a sync, the headers say the files are clean
+//once the tree is closed, so after a crash the tree is still rebuilt
+//with WAL_ENABLED every commit saves the dirty pages (as images for the log) - the cleaner only has the next commit
+//checkpoint the log every CLEANER_CHECKPOINT_MS, between operations, where the headers can describe the files
+//only pages nobody has pinned are saved (under the latch of their shard, data pages under data_latch) while the tree is
+//latched shared - pages being changed, by point operations or by the ones holding the tree exclusively, never are
+
+struct Page_cleaner
+{
+    thread worker;
+    mutex latch;
+    condition_variable wake;
+    bool stopping = false;
+    B_tree* tree = nullptr;
+    atomic<unsigned int> pages_saved{0};        //not counted as writes of the operations running meanwhile
+
+    ~Page_cleaner()
+    {
+        stop();
+    }
 
-            tree->insert(to_insert);
+    void start(B_tree* cleaned_tree)
+    {
+        if ((!WAL_ENABLED && CLEANER_DIRTY_RATIO <= 0) || worker.joinable())
+        {
+            return;
         }
+        tree = cleaned_tree;
+        stopping = false;
+        worker = thread(&Page_cleaner::work, this);
+    }
 
-        // REMOVE
-        else if (line.rfind("remove(", 0) == 0)
+    void stop()
+    {
+        if (!worker.joinable())
         {
-            line = line.substr(7, line.size() - 8);
-
-            unsigned int key = stoi(line);
-            tree->remove(key);
+            return;
         }
-
-        else if (line.rfind("update(", 0)==0)
         {
-            line = line.substr(7, line.size() - 8);
-            stringstream ss(line);
-            Record r;
-            ss>>r.key;
-            for (int i = 0; i < 5; i++)
-                ss >> r.sides[i];
-
-            tree->update_record(r);
+            lock_guard<mutex> lock(latch);
+            stopping = true;
         }
+        wake.notify_all();
+        worker.join();
+    }
 
-        else if (line.rfind("read(", 0)==0)
+    void work()
+    {
+        chrono::steady_clock::time_point last_checkpoint = chrono::steady_clock::now();
+        unique_lock<mutex> lock(latch);
+        while (!wake.wait_for(lock, chrono::milliseconds(CLEANER_INTERVAL_MS), [this] { return stopping; }))
         {
-            line = line.substr(7, line.size() - 8);
-
-            unsigned int key = stoi(line);
-            tree->read_record(key);
+            lock.unlock();
+            bool checkpoint = chrono::steady_clock::now() - last_checkpoint >= chrono::milliseconds(CLEANER_CHECKPOINT_MS);
+            clean(checkpoint);
+            if (checkpoint)
+            {
+                last_checkpoint = chrono::steady_clock::now();
+            }
+            lock.lock();
         }
+    }
 
-        else
+    void clean(bool checkpoint)
+    {
+        if (wal.logging)
         {
-            cerr << "Unknown operation: " << line << endl;
+            if (checkpoint)
+            {
+                wal.checkpoint_requested = true;
+            }
+            return;
+        }
+        shared_lock<Tree_latch> tree_lock(tree->tree_latch);
+        Page_file* index = get_page_file(tree->index_dat_filename);
+        Page_file* data = get_page_file(tree->data_dat_filename);
+        if (!index || !data)
+        {
+            return;
+        }
+        for (unique_ptr<Buffer_shard<B_tree_page>>& shard : index_buffer.shards)
+        {
+            lock_guard<mutex> lock(shard->latch);
+            clean_shard(*shard, checkpoint, index, store_index_page);
+        }
+        {
+            lock_guard<mutex> lock(data_latch);
+            for (unique_ptr<Buffer_shard<Data_page>>& shard : data_buffer.shards)
+            {
+                clean_shard(*shard, checkpoint, data, store_data_page);
+            }
+        }
+        if (checkpoint)
+        {
+            index->sync_file();
+            data->sync_file();
         }
     }
 
-    in.close();
-}
+    //the caller holds the shard's latch - saved pages are written together (see Write_batch)
+    template <typename Page>
+    void clean_shard(Buffer_shard<Page>& shard, bool checkpoint, Page_file* file, void (*store)(Page_file*, unsigned int, const Page&))
+    {
+        unsigned int dirty = 0;     //pinned pages are left alone, changes of their dirty flag aren't looked at
+        shard.for_each_page([&dirty](unsigned int, Page& page)
+        {
+            dirty += page.pin_count == 0 && page.dirty ? 1 : 0;
+        });
+        unsigned int target = checkpoint ? 0 : (unsigned int)(CLEANER_DIRTY_RATIO * shard.frames.size());
+        if (dirty <= target)
+        {
+            return;
+        }
+        target /= 2;
+        Write_batch batch;
+        write_batch = &batch;
+        shard.for_each_page([&](unsigned int page_id, Page& page)
+        {
+            if (dirty > target && page.pin_count == 0 && page.dirty)
+            {
+                page.dirty = false;
+                store(file, page_id, page);
+                pages_saved++;
+                dirty--;
+            }
+        });
+        write_batch = nullptr;
+        batch.write();
+    }
+};
 
+Page_cleaner page_cleaner;
 
-//create data pages on disk
-void txt_to_dat(const string &txt, const string &dat) {
-    ifstream in(txt);
-    ofstream out(dat, ios::binary | ios::out | ios::trunc);  // trunc - file will be overwritten/created
+//index records in the temporary files of bulk loading: key (variable-length one after its length byte), page_id, offset
+//and (clustered tree) sides of the record
+void write_index_record(ofstream& out, const B_tree_record& rec)
+{
+    char buffer[sizeof(B_tree_record) + MAX_KEY_BYTES + 1];
+    char* pos = buffer;
+    if (!Key_traits<Key>::fixed_size)
+    {
+        *pos++ = (char)Key_traits<Key>::bytes(rec.key);
+    }
+    Key_traits<Key>::put(pos, rec.key);
+    put_bytes(pos, &rec.page_id, sizeof(unsigned int));
+    put_bytes(pos, &rec.offset, sizeof(unsigned int));
+    if (tree_config.clustered)
+    {
+        put_bytes(pos, rec.sides, sizeof(rec.sides));
+    }
+    out.write(buffer, pos - buffer);
+}
 
-    if (!in.is_open()) {
-        cerr << "Error: Couldn't open .txt file"<< endl;
-        return;
+bool read_index_record(ifstream& in, B_tree_record& rec)
+{
+    char buffer[sizeof(B_tree_record) + MAX_KEY_BYTES + 1];
+    unsigned int length = sizeof(Key);
+    if (!Key_traits<Key>::fixed_size)
+    {
+        unsigned char size;
+        if (!in.read(reinterpret_cast<char*>(&size), 1))
+        {
+            return false;
+        }
+        length = min((unsigned int)size, Key_traits<Key>::max_bytes());
     }
-    if (!out.is_open()) {
-        cerr << "Error: Couldn't open .dat file" << endl;
-        return;
+    if (!in.read(buffer, length + 2 * sizeof(unsigned int) + (tree_config.clustered ? sizeof(rec.sides) : 0)))
+    {
+        return false;
+    }
+    const char* pos = buffer;
+    rec.key = Key_traits<Key>::get(pos, length);
+    get_bytes(pos, &rec.page_id, sizeof(unsigned int));
+    get_bytes(pos, &rec.offset, sizeof(unsigned int));
+    if (tree_config.clustered)
+    {
+        get_bytes(pos, rec.sides, sizeof(rec.sides));
     }
+    return true;
+}
 
-    Data_page current_page;
-    Record r;
-    while (true) {
-        current_page.rec_num = 0;
-        current_page.id = next_data_page_id;
-        current_page.dirty = false;
-        for(int i = 0; i<DATA_PAGE_SIZE; i++)
-        {           
-            current_page.slot_free[i] = true;
-            if (!(in >> r.key)) 
+//reads index records (key, data page id, offset) of all the records in data.dat and sorts them
+//if there are more than BULK_LOAD_MEMORY_LIMIT records, sorted runs are saved to temporary files and merged
+//returns number of unique keys, sorted records are in `records` or (if run_filename is not empty) in that file
+unsigned long long sort_index_records(const string& data_filename, vector<B_tree_record>& records, string& run_filename)
+{
+    Page_file* data = get_page_file(data_filename);
+    if (!data)
+    {
+        return 0;
+    }
+    auto record_less = [](const B_tree_record& a, const B_tree_record& b) { return key_less(a.key, b.key); };
+
+    vector<string> runs;
+    Data_page dpage;
+    for (unsigned int dpage_id = 0; load_data_page(data, dpage_id, dpage); dpage_id++)
+    {
+        for (unsigned int i = 0; i < tree_config.data_page_records; i++)
+        {
+            if (!dpage.slot_free(i))
             {
-                for(int k = i; k<DATA_PAGE_SIZE; k++)
-                {
-                    current_page.slot_free[k] = true;
-                }
-                data_pages_with_free_slots.push_back(current_page.id);
-                break;      //eof
+                B_tree_record rec = {dpage.records[i].key, dpage_id, i};
+                copy_n(dpage.records[i].sides, 5, rec.sides);
+                records.push_back(rec);
             }
-            for (int j = 0; j < 5; j++)
+        }
+        if (records.size() >= BULK_LOAD_MEMORY_LIMIT)
+        {
+            //saving sorted run
+            sort(records.begin(), records.end(), record_less);
+            string name = string(BULK_LOAD_TMP_FILENAME) + to_string(runs.size());
+            ofstream run(name, ios::binary | ios::trunc);
+            for (const B_tree_record& rec : records)
             {
-                in >> r.sides[j];
+                write_index_record(run, rec);
             }
-                current_page.records[i] = r;
-                current_page.rec_num++;
-                current_page.slot_free[i] = false;
+            runs.push_back(name);
+            records.clear();
         }
-        if (current_page.rec_num == 0)
+    }
+    sort(records.begin(), records.end(), record_less);
+
+    unsigned long long unique_num = 0;
+    if (runs.empty())
+    {
+        //everything fits in RAM - removing duplicated keys in place
+        for (unsigned long long i = 0; i < records.size(); i++)
         {
-            break;
+            if (unique_num > 0 && key_equal(records[unique_num - 1].key, records[i].key))
+            {
+                cerr << "Error: Key " << records[i].key << " appears more than once in " << data_filename << ", skipping it." << endl;
+                continue;
+            }
+            records[unique_num++] = records[i];
         }
-        out.write((char*)&current_page, sizeof(Data_page));
-        next_data_page_id++;
+        records.resize(unique_num);
+        return unique_num;
     }
-    in.close();
-    out.close();
-}
 
-void init_B_tree_page(B_tree_page* page)
-{
-    if(free_list_head != UINT_MAX)
+    //merging runs (the rest of the records in RAM is the last run) into one file
+    vector<ifstream> inputs;
+    for (const string& name : runs)
     {
-       page = get_index_page(free_list_head, INDEX_DAT_FILENAME);
-       free_list_head = page->next_free;
+        inputs.emplace_back(name, ios::binary);
     }
-    else 
+    run_filename = string(BULK_LOAD_TMP_FILENAME) + "merged";
+    ofstream out(run_filename, ios::binary | ios::trunc);
+
+    //heap of (record, run number), run number == runs.size() means records left in RAM
+    auto heap_greater = [](const pair<B_tree_record, unsigned int>& a, const pair<B_tree_record, unsigned int>& b) { return key_less(b.first.key, a.first.key); };
+    priority_queue<pair<B_tree_record, unsigned int>, vector<pair<B_tree_record, unsigned int>>, decltype(heap_greater)> heap(heap_greater);
+    unsigned long long memory_pos = 0;
+    auto read_next = [&](unsigned int run)
+    {
+        B_tree_record rec;
+        if (run == runs.size())
+        {
+            if (memory_pos < records.size())
+            {
+                heap.push({records[memory_pos++], run});
+            }
+        }
+        else if (read_index_record(inputs[run], rec))
+        {
+            heap.push({rec, run});
+        }
+    };
+    for (unsigned int run = 0; run <= runs.size(); run++)
     {
-        page->id = next_page_id;
+        read_next(run);
     }
-    page->keys_num = 0;
-    page->parent_id = UINT_MAX;
-    page->dirty = true;
-    page->next_free = UINT_MAX;
-    page->pin_count = 0;
-
-    for (unsigned int i = 0; i < MAX_KEYS + 1; i++)
+    Key last_key = no_key;
+    while (!heap.empty())
     {
-        page->keys[i] = {UINT_MAX,  UINT_MAX, UINT_MAX};
+        pair<B_tree_record, unsigned int> top = heap.top();
+        heap.pop();
+        read_next(top.second);
+        if (unique_num > 0 && key_equal(top.first.key, last_key))
+        {
+            cerr << "Error: Key " << top.first.key << " appears more than once in " << data_filename << ", skipping it." << endl;
+            continue;
+        }
+        write_index_record(out, top.first);
+        last_key = top.first.key;
+        unique_num++;
     }
-
-    for (unsigned int i = 0; i < MAX_KEYS + 2; i++)
+    inputs.clear();
+    for (const string& name : runs)
     {
-        page->children_id[i] = UINT_MAX;
+        remove(name.c_str());
     }
-
-    next_page_id++;
-
-    write_index_page(page->id, *page, INDEX_DAT_FILENAME);
+    records.clear();
+    return unique_num;
 }
 
-void free_index_page(unsigned int id)
+//page being filled on a single level of the tree during bulk loading
+struct Bulk_level
 {
-    B_tree_page* page = get_index_page(id, INDEX_DAT_FILENAME);
-    if (!page) 
+    unsigned long long items;       //slots on the level
+    unsigned long long pages;
+    unsigned int first_page_id;
+    unsigned long long current;     //number of the page being filled
+    unsigned int slots_per_key;     //page with k keys takes k+1 slots, B+-tree leaf only k
+    vector<unsigned int> page_keys;     //compressed or slotted pages: keys of every page of the level
+    B_tree_page page;
+
+    unsigned int target_keys()      //slots are spread evenly among the pages
     {
-        return;
+        if (!page_keys.empty())
+        {
+            return page_keys[current];
+        }
+        return items / pages + (current < items % pages ? 1 : 0) + 1 - slots_per_key;
     }
+};
 
-    page->pin_count--;
-    page->next_free = free_list_head;
-    free_list_head = id;
-
-    write_index_page(id, *page, INDEX_DAT_FILENAME);
-}
-
-
-B_tree_page* get_index_page(unsigned int page_id, const string& filename)
+//compressed or slotted pages: pages of one level are filled in order until their encoded form reaches BULK_LOAD_FILL_FACTOR
+//of the page size - keys coming to the level (records or separators from the level below) are counted before the tree is built
+struct Bulk_sized_level
 {
-    if (page_id == UINT_MAX)
+    bool leaves;
+    unsigned int min_keys;
+    unsigned int max_keys;
+    vector<unsigned int> page_keys;
+    vector<Key> separators;     //keys going up to the level above
+    vector<B_tree_record> previous;         //keys of the last two pages, evened at the end
+    vector<B_tree_record> current;
+    Page_bytes size;
+
+    Bulk_sized_level(bool leaf_level)
     {
-        cerr<<"Error: Tried to get index page number UINT_MAX"<<endl;
-        return nullptr;
+        leaves = leaf_level;
+        min_keys = leaves ? tree_config.min_keys : tree_config.min_interior_keys;
+        max_keys = leaves ? tree_config.max_keys : tree_config.max_interior_keys;
+        open_page();
     }
-
-    //page in RAM - don't read it from disk
-    unordered_map<unsigned int, unique_ptr<B_tree_page>>::iterator it = index_buffer.find(page_id);
-    if (it != index_buffer.end())
+    void open_page()
     {
-        it->second->pin_count++;
-        return it->second.get();
+        current.clear();
+        size = Page_bytes();
+        if (!leaves)
+        {
+            size.add_child(INT_MAX);        //first child may take the longest varint, the next ones have consecutive ids
+        }
     }
-    //page not in RAM - read it from disk
-    ifstream index(filename, ios::binary);
-    if (!index.is_open())
+    void add_to_size(Page_bytes& page_size, const B_tree_record& rec)
     {
-        cerr << "Error: Couldn't open " << filename << endl;
-        return nullptr;
+        page_size.add_key(rec.key);
+        if (leaves)
+        {
+            page_size.add_pointer({rec.page_id, rec.offset});
+        }
+        else
+        {
+            page_size.add_child(page_size.last_id + 1);
+        }
     }
-
-    B_tree_page page;
-    index.seekg(page_id * sizeof(B_tree_page), ios::beg);
-    index.read(reinterpret_cast<char*>(&page), sizeof(B_tree_page));
-
-    if (!index)
+    void add(const B_tree_record& rec)
     {
-        cerr << "Error: Couldn't read index page " << page_id << endl;
-        return nullptr;
+        Page_bytes grown = size;
+        add_to_size(grown, rec);
+        unsigned int bytes = tree_config.index_page_size;
+        if (current.size() < max_keys && grown.bytes() <= bytes && (grown.bytes() <= BULK_LOAD_FILL_FACTOR * bytes || current.size() < min_keys))
+        {
+            size = grown;
+            current.push_back(rec);
+            return;
+        }
+        //B+-tree: the key starting a new leaf goes up as its copy, on upper levels the key itself goes up
+        page_keys.push_back(current.size());
+        separators.push_back(rec.key);
+        previous.swap(current);
+        open_page();
+        if (leaves)
+        {
+            add_to_size(size, rec);
+            current.push_back(rec);
+        }
     }
-
-    read_count_index++;
-    if (index_buffer.size() >= INDEX_BUFFER_LIMIT)
+    //the last page gets at least min_keys - it's joined with the previous one if they fit in one page,
+    //otherwise keys are moved to it from the previous one
+    void finish()
     {
-        for (auto it = index_buffer.begin(); it != index_buffer.end(); )
+        if (page_keys.empty() || current.size() >= min_keys)
         {
-            if (it->second->pin_count <= 0)
-            {
-                if (it->second->dirty)
-                {
-                    write_index_page(it->first, *(it->second), filename);
-                    it->second->dirty = false;
-                }
-                it = index_buffer.erase(it);
-            }
-            else
-            {
-                ++it;
-            }
-
-            if (index_buffer.size() < INDEX_BUFFER_LIMIT)
-            {
-                break;
-            }
+            page_keys.push_back(current.size());
+            return;
         }
+        vector<B_tree_record> keys = previous;
+        if (!leaves)
+        {
+            keys.push_back({separators.back(), UINT_MAX, UINT_MAX});
+        }
+        keys.insert(keys.end(), current.begin(), current.end());
+        open_page();
+        for (unsigned int i = 0; i < keys.size(); i++)
+        {
+            add_to_size(size, keys[i]);
+        }
+        if (keys.size() <= max_keys && size.bytes() <= tree_config.index_page_size)
+        {
+            page_keys.back() = keys.size();
+            separators.pop_back();
+            return;
+        }
+        //min_keys always fit and the previous page only loses keys from its end
+        unsigned int previous_keys = keys.size() - min_keys - (leaves ? 0 : 1);
+        page_keys.back() = previous_keys;
+        separators.back() = keys[previous_keys].key;
+        page_keys.push_back(min_keys);
     }
+};
 
-    if (index_buffer.size() >= INDEX_BUFFER_LIMIT)
+//number of pages needed on one level of the tree to hold `items` slots, where a page with k keys takes k+1 slots
+//(B-tree leaves: all keys + 1, upper levels: number of pages on the level below)
+//or k slots (B+-tree leaves: all keys)
+//every page gets between min_keys and max_keys keys, as close to target_keys as possible
+unsigned long long bulk_level_pages(const Bulk_level& level, unsigned int target_keys, unsigned int min_keys, unsigned int max_keys)
+{
+    unsigned long long items = level.items;
+    unsigned int extra = level.slots_per_key - 1;
+    if (items <= max_keys + extra)
     {
-        cerr<<"Error: Index pages buffer is too small to handle operation (all pages are being used). Try setting higher INDEX_BUFFER_LIMIT."<<endl;
-        return nullptr;
+        return 1;       //fits in a single page (the root)
     }
-
-    index_buffer[page_id] = std::make_unique<B_tree_page>(page);
-    index_buffer[page_id]->pin_count++;
-    return index_buffer[page_id].get();
-
+    unsigned long long pages = (items + target_keys + extra - 1) / (target_keys + extra);
+    unsigned long long max_pages = items / (min_keys + extra);        //more pages would have less than min_keys keys
+    unsigned long long min_pages = (items + max_keys + extra - 1) / (max_keys + extra);
+    return max(min_pages, min(pages, max_pages));
 }
 
-void write_index_page(unsigned int page_id, B_tree_page& page, const string& filename)
+unsigned int bulk_target_keys(unsigned int min_keys, unsigned int max_keys)
 {
-    fstream index(filename, ios::binary | ios::in | ios::out);
-    if (!index.is_open())
-    {
-        cerr << "Error: Couldn't open " << filename << endl;
-        return;
-    }
-
-    page.dirty = false;
-    index.seekp(page_id * sizeof(B_tree_page), ios::beg);
-    index.write(reinterpret_cast<const char*>(&page), sizeof(B_tree_page));
-
-    write_count_index++;
+    unsigned int target_keys = (unsigned int)(BULK_LOAD_FILL_FACTOR * max_keys + 0.5);
+    return max(min_keys, min(max_keys, target_keys));
 }
 
-void flush_index_buffer(const string& filename)         //saves to the file if dirty=true
+void bulk_open_page(vector<Bulk_level>& levels, unsigned int level)
 {
-    for (auto& [page_id, page] : index_buffer)
+    B_tree_page* page = &levels[level].page;
+    page->reset();
+    page->id = levels[level].first_page_id + levels[level].current;
+    page->dirty = true;
+    page->pin_count = 0;
+    if (level == 0 && tree_config.bplus_tree)
     {
-        if (page->dirty)
+        //leaves of a level get consecutive ids
+        if (levels[0].current > 0)
         {
-            page->dirty = false;
-            write_index_page(page_id, *page, filename);
+            page->prev_leaf = page->id - 1;
         }
+        if (levels[0].current + 1 < levels[0].pages)
+        {
+            page->next_leaf = page->id + 1;
+        }
+    }
+    if (level + 1 < levels.size())
+    {
+        //new page becomes the next child of the page being filled on the upper level
+        B_tree_page* parent = &levels[level + 1].page;
+        parent->children_id[parent->keys_num] = page->id;
     }
 }
 
-Data_page* get_data_page(unsigned int page_id, const string& filename)
+//B+-tree: a new page on the level below starts with key - its copy goes up as a separator
+//before the page is opened, completing upper pages that are full
+void bulk_add_separator(vector<Bulk_level>& levels, unsigned int level, const Key& key)
 {
-    unordered_map<unsigned int, Data_page>::iterator it = data_buffer.find(page_id);
-    if (it != data_buffer.end())
-        return &it->second;
-
-    ifstream data(filename, ios::binary);
-    if (!data.is_open())
+    if (level >= levels.size())
     {
-        cerr << "Error: Couldn't open " << filename << endl;
-        return nullptr;
+        cerr << "Error: Bulk loading ran out of pages" << endl;        //shouldn't happen
+        return;
     }
+    B_tree_page* page = &levels[level].page;
+    if (page->keys_num == levels[level].target_keys())
+    {
+        write_index_page(page->id, *page, INDEX_DAT_FILENAME);
+        levels[level].current++;
+        bulk_add_separator(levels, level + 1, key);
+        bulk_open_page(levels, level);
+        return;
+    }
+    page->set_record(page->keys_num++, {key, UINT_MAX, UINT_MAX});
+}
 
-    Data_page page;
-    data.seekg(page_id * sizeof(Data_page), ios::beg);
-    data.read(reinterpret_cast<char*>(&page), sizeof(Data_page));
-
-    if (!data)
+//builds the B-tree bottom-up from records sorted by key: pages are filled left to right
+//(every (target+1)-th key going up as a separator, B+-tree: copy of the first key of every leaf but the first)
+//and each of them is written exactly once
+void bulk_load_b_tree(B_tree* tree_p, const string& data_filename)
+{
+    vector<B_tree_record> records;
+    string run_filename;
+    unsigned long long records_num = sort_index_records(data_filename, records, run_filename);
+    if (records_num == 0)
     {
-        cerr << "Error: Couldn't read data page " << page_id << endl;
-        return nullptr;
+        return;
+    }
+    ifstream run;
+    if (!run_filename.empty())
+    {
+        run.open(run_filename, ios::binary);
     }
 
-    read_count_data++;
-    if (data_buffer.size() >= INDEX_BUFFER_LIMIT)
+    //shape of the tree - levels from the leaves up
+    vector<Bulk_level> levels;
+    unsigned long long items = tree_config.bplus_tree ? records_num : records_num + 1;
+    vector<Bulk_sized_level> sized_levels;
+    if (tree_config.sized_pages)
     {
-        auto victim = data_buffer.begin(); //removing first page from the buffer
-        if (victim->second.dirty)
+        //records are read once more to count the keys of the leaves
+        sized_levels.emplace_back(true);
+        for (unsigned long long n = 0; n < records_num; n++)
+        {
+            B_tree_record rec;
+            if (run_filename.empty())
+            {
+                rec = records[n];
+            }
+            else
+            {
+                read_index_record(run, rec);
+            }
+            sized_levels[0].add(rec);
+        }
+        sized_levels[0].finish();
+        while (sized_levels.back().page_keys.size() > 1)
+        {
+            Bulk_sized_level upper(false);
+            for (const Key& key : sized_levels.back().separators)
+            {
+                upper.add({key, UINT_MAX, UINT_MAX});
+            }
+            upper.finish();
+            sized_levels.push_back(move(upper));
+        }
+        if (!run_filename.empty())
         {
-            victim->second.dirty = false;
-            write_data_page(victim->first, victim->second, filename);
+            run.clear();
+            run.seekg(0);
         }
-        data_buffer.erase(victim);
     }
-    data_buffer[page_id] = page;
-    return &data_buffer[page_id];
-}
-
-void write_data_page(unsigned int page_id, Data_page& page, const string& filename)
-{
-    fstream data(filename, ios::binary | ios::in | ios::out);
-    if (!data.is_open())
+    for (unsigned int l = 0; l < sized_levels.size(); l++)
     {
-        cerr << "Error: Couldn't open " << filename << endl;
-        return;
+        levels.emplace_back();
+        Bulk_level& level = levels.back();
+        level.page_keys = move(sized_levels[l].page_keys);
+        level.items = records_num;
+        level.pages = level.page_keys.size();
+        level.slots_per_key = l == 0 ? 1 : 2;
+        level.current = 0;
     }
-
-    page.dirty = false;
-    data.seekp(page_id * sizeof(Data_page), ios::beg);
-    data.write(reinterpret_cast<const char*>(&page), sizeof(Data_page));
-
-    write_count_data++;
-    data_buffer[page_id] = page;
-}
-
-void print_data_dat(const string &filename)
-{
-    flush_all_buffers(DATA_DAT_FILENAME, INDEX_DAT_FILENAME);
-    ifstream data(filename, ios::binary | ios::in);
-    if(!data.is_open())
+    while (!tree_config.sized_pages)
     {
-        cerr << "Error: Couldn't open " << filename << endl;
-        return;
+        bool leaves = levels.empty();
+        levels.emplace_back();
+        Bulk_level& level = levels.back();
+        level.items = items;
+        level.slots_per_key = leaves && tree_config.bplus_tree ? 1 : 2;
+        level.current = 0;
+        if (leaves)
+        {
+            level.pages = bulk_level_pages(level, bulk_target_keys(tree_config.min_keys, tree_config.max_keys), tree_config.min_keys, tree_config.max_keys);
+        }
+        else
+        {
+            level.pages = bulk_level_pages(level, bulk_target_keys(tree_config.min_interior_keys, tree_config.max_interior_keys), tree_config.min_interior_keys, tree_config.max_interior_keys);
+        }
+        if (level.pages == 1)
+        {
+            break;
+        }
+        items = level.pages;
     }
+    //page ids are given from the root down, so the root is page 0
+    unsigned int page_id = 0;
+    for (int l = levels.size() - 1; l >= 0; l--)
+    {
+        levels[l].first_page_id = page_id;
+        page_id += levels[l].pages;
+    }
+    next_page_id = page_id;
 
-    cout<<"Contents of the "<<filename<<" file\n"<<endl;
-
-    Data_page current_page;
-    unsigned int current_id = 0;
-
-    while(true)
+    for (int l = levels.size() - 1; l >= 0; l--)
     {
-        data.seekg(current_id * sizeof(Data_page), ios::beg);
-        data.read((char*)&current_page, sizeof(Data_page));
+        bulk_open_page(levels, l);
+    }
 
-        if(!data)
+    for (unsigned long long n = 0; n < records_num; n++)
+    {
+        B_tree_record rec;
+        if (run_filename.empty())
         {
-            break;      //eof
+            rec = records[n];
+        }
+        else
+        {
+            read_index_record(run, rec);
         }
 
-        cout<<"Data page ["<<current_page.id<<"]:"<<endl;
-        cout<<"dirty = "<<current_page.dirty<<endl;
-        cout<<"rec_num = "<<current_page.rec_num<<endl;
-        cout<<"Records:"<<endl;
-        for(int i = 0; i<DATA_PAGE_SIZE; i++)
+        if (tree_config.bplus_tree)
         {
-            cout<<i<<": ";
-            if(current_page.slot_free[i])
-            {
-                cout<<"free slot"<<endl;
-            }
-            else
+            //every record goes to a leaf, starting a new one when the current is full
+            B_tree_page* leaf = &levels[0].page;
+            if (leaf->keys_num == levels[0].target_keys())
             {
-                cout<<"Key: "<<current_page.records[i].key<<" Sides:";
-                for(int j = 0; j<5; j++)
-                {
-                    cout<<" "<<current_page.records[i].sides[j];
-                }
-                cout<<endl;
+                write_index_page(leaf->id, *leaf, INDEX_DAT_FILENAME);
+                levels[0].current++;
+                bulk_add_separator(levels, 1, rec.key);
+                bulk_open_page(levels, 0);
             }
+            leaf->set_record(leaf->keys_num++, rec);
+            continue;
         }
-        cout<<endl;
 
-        current_id++;
-    }
+        //the record goes to the lowest level whose current page isn't full yet
+        unsigned int l = 0;
+        while (l + 1 < levels.size() && levels[l].page.keys_num == levels[l].target_keys())
+        {
+            l++;
+        }
+        B_tree_page* page = &levels[l].page;
+        page->set_record(page->keys_num++, rec);
 
-    data.close();
-}
+        //pages below are complete - saving them and starting the next ones
+        for (int m = l - 1; m >= 0; m--)
+        {
+            write_index_page(levels[m].page.id, levels[m].page, INDEX_DAT_FILENAME);
+            levels[m].current++;
+            bulk_open_page(levels, m);
+        }
+    }
 
-void flush_data_buffer(const string& filename)      //modifies dirty data pages
-{
-    for (auto& [page_id, page] : data_buffer)
+    for (unsigned int l = 0; l < levels.size(); l++)
     {
-        if (page.dirty)
+        if (levels[l].page.keys_num != levels[l].target_keys())
         {
-            page.dirty = false;
-            write_data_page(page_id, page, filename);
+            cerr << "Error: Bulk loading ended with incomplete page " << levels[l].page.id << endl;     //shouldn't happen
         }
+        write_index_page(levels[l].page.id, levels[l].page, INDEX_DAT_FILENAME);
     }
-}
+    tree_p->root = levels.back().first_page_id;
 
-void remove_rec_from_data_dat(B_tree_record rec)
-{
-    Data_page* dpage = get_data_page(rec.page_id, DATA_DAT_FILENAME);
-    dpage->slot_free[rec.offset] = true;
-    dpage->dirty = true;
-    dpage->rec_num--;
-    auto it = find(data_pages_with_free_slots.begin(), data_pages_with_free_slots.end(), dpage->id);
-    if(it == data_pages_with_free_slots.end())
+    if (!run_filename.empty())
     {
-        data_pages_with_free_slots.push_back(dpage->id);
+        run.close();
+        remove(run_filename.c_str());
     }
 }
 
-void update_rec_in_data_dat (B_tree_record rec_to_change, Record new_rec)
+//opens the tree described by headers of index.dat and data.dat without reading any of its pages
+//returns false if the files don't hold a properly closed tree (it has to be created from scratch then)
+bool open_b_tree(B_tree* tree_p, const string& data_filename)
 {
-    Data_page* dpage = get_data_page(rec_to_change.page_id, DATA_DAT_FILENAME);
-
-    for (int i = 0; i < 5; i++)
+    Page_file* data = get_page_file(data_filename);
+    Page_file* index = get_page_file(INDEX_DAT_FILENAME);
+    File_header data_header;
+    File_header index_header;
+    if (!data || !index || !read_file_header(data, DATA_FILE_MAGIC, data_header) || !read_file_header(index, INDEX_FILE_MAGIC, index_header))
     {
-        if(new_rec.sides[i] <= 0)
-        {
-            cout<<"Error: Record has invalid value. Sides need to be a real number larger than 0."<<endl;
-            return;
-        }
+        return false;
     }
-
-    for(int i = 0; i<5; i++)
+    if (!data_header.clean || !index_header.clean)
     {
-        dpage->records[rec_to_change.offset].sides[i] = new_rec.sides[i];
+        cerr << "Error: " << INDEX_DAT_FILENAME << " and " << data_filename << " weren't closed properly, the B-tree will be rebuilt" << endl;
+        return false;
+    }
+    if (data_header.key_type != Key_traits<Key>::id || index_header.key_type != Key_traits<Key>::id)
+    {
+        cerr << "Error: " << INDEX_DAT_FILENAME << " and " << data_filename << " hold keys of another KEY_TYPE" << endl;
+        return false;
+    }
+    Tree_config config = make_tree_config(index_header.d, data_header.data_page_records, index_header.bplus_tree != 0, index_header.compressed_pages != 0,
+                                          index_header.clustered != 0);
+    if (config.index_page_size != index_header.page_size || config.data_page_size != data_header.page_size)
+    {
+        cerr << "Error: Page sizes saved in " << INDEX_DAT_FILENAME << " and " << data_filename << " don't match their layout" << endl;
+        return false;
+    }
+    tree_config = config;
+    index_buffer.clear();
+    data_buffer.clear();
+    next_page_id = index_header.next_page_id;
+    free_list_head = index_header.free_list_head;
+    free_index_pages = index_header.free_index_pages;
+    next_data_page_id = data_header.next_data_page_id;
+    data_records = data_header.data_records;
+    if (!load_free_space_map(next_data_page_id))
+    {
+        cout << FREE_SPACE_MAP_FILENAME << " doesn't describe " << data_filename << ", it's rebuilt from the data pages" << endl;
+        rebuild_free_space_map(data, next_data_page_id);
     }
 
-    dpage->dirty = true;
-}
-
-void flush_all_buffers(const string& data_dat_filename, const string& index_dat_filename)
-{
-    flush_index_buffer(index_dat_filename);
-    flush_data_buffer(data_dat_filename);
+    tree_p->root = index_header.root;
+    tree_p->index_dat_filename = INDEX_DAT_FILENAME;
+    tree_p->data_dat_filename = data_filename;
+    cout << "B-tree opened from " << INDEX_DAT_FILENAME << " (d = " << tree_config.d << ", " << next_page_id << " index pages, "
+         << next_data_page_id << " data pages)" << endl << endl;
+    return true;
 }
 
 void create_b_tree(B_tree* tree_p, const string& data_filename)
 {
     //Opening files
-    ifstream data(data_filename, ios::binary);
-    ofstream index(INDEX_DAT_FILENAME, ios::binary | ios::out | ios::trunc);
+    Page_file* data = get_page_file(data_filename);
+    Page_file* index = get_page_file(INDEX_DAT_FILENAME);
 
-    if (!data.is_open())
+    if (!data || !index)
     {
-        cerr << "Error: Couldn't open " << data_filename << endl;
         return;
     }
-    if (!index.is_open())
+    tree_p->root = UINT_MAX;
+    //data pages layout is taken from data.dat
+    File_header data_header;
+    if (read_file_header(data, DATA_FILE_MAGIC, data_header))
     {
-        cerr << "Error: Couldn't open " << INDEX_DAT_FILENAME << endl;
-        return;
+        if (data_header.key_type != Key_traits<Key>::id)
+        {
+            cerr << "Error: " << data_filename << " holds keys of another KEY_TYPE" << endl;
+            return;
+        }
+        tree_config = make_tree_config(tree_config.d, data_header.data_page_records, tree_config.bplus_tree, tree_config.compressed_pages, tree_config.clustered);
     }
-
+    index->truncate_file();
     index_buffer.clear();
+    next_page_id = 0;
+    free_list_head = UINT_MAX;
+    free_index_pages = 0;
+    write_file_header(index, INDEX_FILE_MAGIC, UINT_MAX, false);
 
     //Creating empty B-tree
     tree_p->root = UINT_MAX;
     tree_p->index_dat_filename = INDEX_DAT_FILENAME;
     tree_p->data_dat_filename = DATA_DAT_FILENAME;
 
+    if (BULK_LOAD)
+    {
+        bulk_load_b_tree(tree_p, data_filename);
+        cout << "B-tree successfully created from " << data_filename << endl << endl;
+        if(PRINT_FILES)
+        {
+            tree_p->print();
+        }
+        return;
+    }
+
     Data_page dpage;
     unsigned int dpage_id = 0;
 
     while (true)
     {
-        data.seekg(dpage_id * sizeof(Data_page), ios::beg);
-        data.read((char*)&dpage, sizeof(Data_page));
-
-        if (!data)
+        if (!load_data_page(data, dpage_id, dpage))
         {
             break;
         }
@@ -1522,7 +6816,7 @@ void create_b_tree(B_tree* tree_p, const string& data_filename)
         //filling index pages
         for (unsigned int i = 0; i < dpage.rec_num; i++)
         {
-            if (dpage.slot_free[i]) continue;
+            if (dpage.slot_free(i)) continue;
 
             Record r = dpage.records[i];
 
@@ -1530,18 +6824,7 @@ void create_b_tree(B_tree* tree_p, const string& data_filename)
             rec.key = r.key;
             rec.page_id = dpage_id;
             rec.offset = i;
-
-            if (tree_p->root == UINT_MAX)
-            {
-
-                B_tree_page root_page;
-                B_tree_page* root = &root_page;
-                init_B_tree_page(root);
-
-                write_index_page(0, *root, INDEX_DAT_FILENAME);
-
-                tree_p->root = 0;
-            }
+            copy_n(r.sides, 5, rec.sides);
 
             //tree_p->insert(r);
             tree_p->insert(rec);
@@ -1550,9 +6833,6 @@ void create_b_tree(B_tree* tree_p, const string& data_filename)
         dpage_id++;
     }
 
-    data.close();
-    index.close();
-
     cout << "B-tree successfully created from " << data_filename << endl << endl;
 }
 
@@ -1582,25 +6862,249 @@ void generate_random_records (const string& filename, unsigned int n,unsigned in
 
 }
 
+//inserts 2n keys into a new tree of n records, one by one (batch_size 1) or in batches, and counts heap allocations
+//made by the last n inserts (the first ones fill the buffers, the path and the scratch spaces), output of the inserts
+//is muted - PRINT_FILES should be false
+void allocation_run(const string& pages, unsigned int n, unsigned int batch_size)
+{
+    generate_random_records(RANDOM_TXT_FILENAME, n);
+    txt_to_dat(RANDOM_TXT_FILENAME, DATA_DAT_FILENAME);
+    B_tree tree;
+    create_b_tree(&tree, DATA_DAT_FILENAME);
+
+    vector<unsigned int> keys(2 * n);
+    for (unsigned int i = 0; i < keys.size(); i++)
+    {
+        keys[i] = n + 1 + i;
+    }
+    mt19937 gen(1);
+    shuffle(keys.begin(), keys.end(), gen);
+
+    cout.setstate(ios::failbit);
+    vector<Record> batch;
+    batch.reserve(batch_size);
+    unsigned int counted = (n + batch_size - 1) / batch_size * batch_size;     //first insert counted, it starts a batch
+    unsigned long long allocations_before = 0;
+    unsigned int allocating_inserts = 0;
+    for (unsigned int i = 0; i < keys.size(); i += batch_size)
+    {
+        if (i == counted)
+        {
+            allocations_before = allocation_count;
+        }
+        unsigned long long insert_allocations = allocation_count;
+        batch.clear();
+        for (unsigned int j = i; j < i + batch_size && j < keys.size(); j++)
+        {
+            batch.push_back({Key_traits<Key>::from_number(keys[j]), {1, 1, 1, 1, 1}});
+        }
+        if (batch_size == 1)
+        {
+            tree.insert(place_record(batch[0]));
+        }
+        else
+        {
+            tree.insert_batch(batch);
+        }
+        if (i >= counted && allocation_count != insert_allocations)
+        {
+            allocating_inserts++;
+        }
+    }
+    cout.clear();
+    cout << "Allocation benchmark (" << pages << " pages, " << (batch_size == 1 ? string("one by one") : "batches of " + to_string(batch_size))
+         << "): " << keys.size() - counted << " inserts, " << allocation_count - allocations_before << " heap allocations, "
+         << allocating_inserts << (batch_size == 1 ? " inserts" : " batches") << " allocated memory" << endl;
+
+    flush_all_buffers(DATA_DAT_FILENAME, INDEX_DAT_FILENAME);
+    save_tree_meta(tree.root, true);
+}
+
+//runs allocation_run() for inserts one by one and in batches, with the pages of the configured tree and (if they
+//aren't sized already) with compressed pages, which are split into as many pages as they need
+void allocation_benchmark(unsigned int n)
+{
+    const unsigned int batch_size = 64;
+    Tree_config config = tree_config;
+    string pages = config.sized_pages ? "sized" : "fixed-size";
+    allocation_run(pages, n, 1);
+    allocation_run(pages, n, batch_size);
+    if (!config.sized_pages)
+    {
+        tree_config = make_tree_config(config.d, config.data_page_records, true, true, false);
+        if (tree_config.compressed_pages)
+        {
+            allocation_run("compressed", n, 1);
+            allocation_run("compressed", n, batch_size);
+        }
+        tree_config = config;
+    }
+}
+
+//runs the same number of operations (reads of random keys, every tenth one an insert of a new key) from one thread
+//and from threads_num threads at once on a tree of NUMBER_OF_RECORDS records and compares operations per second,
+//output of the operations is muted
+void threads_benchmark(unsigned int threads_num)
+{
+    if (PRINT_FILES)
+    {
+        cerr << "Error: Threads benchmark needs PRINT_FILES set to false (printing flushes pages latched by other threads)" << endl;
+        return;
+    }
+    generate_random_records(RANDOM_TXT_FILENAME, NUMBER_OF_RECORDS);
+    txt_to_dat(RANDOM_TXT_FILENAME, DATA_DAT_FILENAME);
+    B_tree tree;
+    create_b_tree(&tree, DATA_DAT_FILENAME);
+
+    //an insert keeps at worst its whole path latched, with a new page, a sibling or neighbour and a new root (one level more)
+    //- all of them can fall into the same shard of the buffer
+    pair<B_tree_page*, unsigned int> result = tree.search_for(Key_traits<Key>::from_number(1), &tree.path);
+    if (result.first)
+    {
+        release_index_page(result.first);
+    }
+    unsigned int pinned = tree.path.steps.size() + 4;
+    unsigned int shards_num = index_buffer.shards.size();
+    if (INDEX_BUFFER_LIMIT / shards_num < threads_num * pinned)
+    {
+        cerr << "Error: Index pages buffer is too small for " << threads_num << " threads. Set INDEX_BUFFER_LIMIT to at least "
+             << threads_num * pinned * shards_num << "." << endl;
+        return;
+    }
+
+    unsigned int operations = 100000;
+    unsigned int next_key = NUMBER_OF_RECORDS + 1;       //keys inserted by the runs
+    unsigned int records_num = NUMBER_OF_RECORDS;
+    double per_second[2];
+    cout.setstate(ios::failbit);
+    page_cleaner.start(&tree);
+    for (unsigned int run = 0; run < 2; run++)
+    {
+        unsigned int run_threads = run == 0 ? 1 : threads_num;
+        unsigned int thread_operations = operations / run_threads;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        vector<thread> threads;
+        for (unsigned int t = 0; t < run_threads; t++)
+        {
+            unsigned int first_key = next_key + t * thread_operations;
+            threads.emplace_back([&tree, t, first_key, thread_operations]()
+            {
+                mt19937 gen(t + 1);
+                for (unsigned int i = 0; i < thread_operations; i++)
+                {
+                    if (i % 10 == 0)
+                    {
+                        Record rec = {Key_traits<Key>::from_number(first_key + i), {1, 1, 1, 1, 1}};
+                        tree.insert(place_record(rec));
+                    }
+                    else
+                    {
+                        tree.read_record(Key_traits<Key>::from_number(gen() % NUMBER_OF_RECORDS + 1));
+                    }
+                }
+            });
+        }
+        for (thread& t : threads)
+        {
+            t.join();
+        }
+        chrono::duration<double> seconds = chrono::steady_clock::now() - start;
+        per_second[run] = thread_operations * run_threads / seconds.count();
+        next_key += operations;
+        records_num += run_threads * ((thread_operations + 9) / 10);
+    }
+
+    //every record has to be found afterwards - the ones the tree was built from and the ones inserted by the runs
+    unsigned int records_found = 0;
+    for (unsigned int key = 1; key < next_key; key++)
+    {
+        if (tree.read_record(Key_traits<Key>::from_number(key)).key == Key_traits<Key>::from_number(key))
+        {
+            records_found++;
+        }
+    }
+    page_cleaner.stop();
+    cout.clear();
+    cout << "Threads benchmark: " << operations << " operations (reads, every tenth one an insert), 1 thread: " << (unsigned long long)per_second[0]
+         << " operations/s, " << threads_num << " threads: " << (unsigned long long)per_second[1] << " operations/s" << endl;
+    cout << "Records found after the runs: " << records_found << " of " << records_num << endl;
+
+    flush_all_buffers(DATA_DAT_FILENAME, INDEX_DAT_FILENAME);
+    save_tree_meta(tree.root, true);
+}
+
 //MAIN
 
 int main()
 {
-    if(RANDOM_RECORDS)
+    tree_config = make_tree_config(INDEX_PAGE_BYTES != 0 ? 0 : D_VALUE, DATA_PAGE_RECORDS, BPLUS_TREE, COMPRESSED_PAGES, CLUSTERED);
+    if (ALLOCATION_BENCHMARK != 0)
     {
-        generate_random_records(RANDOM_TXT_FILENAME, NUMBER_OF_RECORDS);
-        txt_to_dat(RANDOM_TXT_FILENAME, DATA_DAT_FILENAME);
+        allocation_benchmark(ALLOCATION_BENCHMARK);
+        close_all_page_files();
+        return 0;
     }
-    else
+    if (THREADS_BENCHMARK != 0)
+    {
+        threads_benchmark(THREADS_BENCHMARK);
+        close_all_page_files();
+        return 0;
+    }
+    unsigned int recovered_root;
+    if (WAL_ENABLED && wal.open(WAL_FILENAME, {INDEX_DAT_FILENAME, DATA_DAT_FILENAME}) && wal.recover(recovered_root))
     {
-        txt_to_dat(MANUAL_TXT_FILENAME, DATA_DAT_FILENAME);
+        cout << "Files recovered from " << WAL_FILENAME << " (" << wal.next_lsn - 1 << " log records)" << endl;
     }
     B_tree tree;
     B_tree* tree_p = &tree;
-    create_b_tree(tree_p, DATA_DAT_FILENAME);
+    if (!OPEN_EXISTING_TREE || !open_b_tree(tree_p, DATA_DAT_FILENAME))
+    {
+        if(RANDOM_RECORDS)
+        {
+            generate_random_records(RANDOM_TXT_FILENAME, NUMBER_OF_RECORDS);
+            txt_to_dat(RANDOM_TXT_FILENAME, DATA_DAT_FILENAME);
+        }
+        else
+        {
+            txt_to_dat(MANUAL_TXT_FILENAME, DATA_DAT_FILENAME);
+        }
+        create_b_tree(tree_p, DATA_DAT_FILENAME);
+        flush_all_buffers(DATA_DAT_FILENAME, INDEX_DAT_FILENAME);
+        save_tree_meta(tree.root, true);
+    }
+    //files are the starting point of the log, without it the headers are out of date until the files are closed
+    save_tree_meta(tree.root, WAL_ENABLED);
+    if (WAL_ENABLED && wal.log)
+    {
+        wal.checkpoint();
+        wal.logging = true;
+    }
+    page_cleaner.start(tree_p);
     process_operations(INSTRUCTIONS_TXT_FILENAME, tree_p);
+    page_cleaner.stop();
+    if (wal.logging)
+    {
+        wal.flush();
+        wal.logging = false;
+    }
     flush_all_buffers(DATA_DAT_FILENAME, INDEX_DAT_FILENAME);
+    save_tree_meta(tree.root, true);
+    if (WAL_ENABLED && wal.log)
+    {
+        wal.checkpoint();
+    }
+    close_all_page_files();
     cout<<"All disk read operations: "<<read_count_data+read_count_index<<endl;
     cout<<"All disk write operations: "<<write_count_data+write_count_index<<endl;
+    if(page_cleaner.pages_saved != 0)
+    {
+        cout<<"Pages saved by the page cleaner: "<<page_cleaner.pages_saved<<endl;
+    }
+    if(WAL_ENABLED)
+    {
+        cout<<"Operations committed: "<<wal.operations<<", log syncs: "<<wal.syncs<<endl;
+    }
+    cout<<"Index buffer ("<<index_buffer.policy_name()<<"): "<<index_buffer.hits()<<" hits, "<<index_buffer.misses()<<" misses"<<endl;
+    cout<<"Data buffer ("<<data_buffer.policy_name()<<"): "<<data_buffer.hits()<<" hits, "<<data_buffer.misses()<<" misses"<<endl;
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,73 @@
+#!/usr/bin/env python3
+# reference model of the operations - records are kept in a dict, prints what run_tests.sh keeps of the output of main
+# usage: model.py data.txt instructions.txt [reopen.txt]
+# if the case has a crash file, only its first that many inserts, removes and updates of instructions.txt are left
+# when the files are reopened
+import os
+import re
+import sys
+
+
+#yields the records after every insert, remove and update (each of them is committed on its own)
+def run(records, filename, out):
+    for line in open(filename):
+        match = re.match(r'^(\w+)\((.*)\)$', line.strip())
+        if not match:
+            continue
+        op, args = match.group(1), match.group(2).split()
+        key = int(args[0]) if args else None
+        if op == 'insert':
+            if key in records:
+                out.append("Error: Couldn't insert record. Record with key %d already exists in the B-tree." % key)
+            else:
+                records[key] = args[1:6]
+        elif op == 'remove':
+            if key not in records:
+                out.append("Error: Couldn't remove record. Record with key %d does not exist in the B-tree." % key)
+            else:
+                del records[key]
+        elif op == 'update':
+            if key not in records:
+                out.append("Error: Couldn't update record. Record with key %d does not exist in the B-tree." % key)
+            else:
+                records[key] = args[1:6]
+        elif op == 'read':
+            if key not in records:
+                out.append("Error: Couldn't read record. Key %d does not exist in the B-tree." % key)
+            else:
+                out.append('Loaded record key = %d' % key)
+                out.append(' '.join(records[key]) + ' ')
+            continue
+        elif op == 'scan':
+            low, high = int(args[0]), int(args[1])
+            keys = sorted(k for k in records if min(low, high) <= k <= max(low, high))
+            if high < low:
+                keys.reverse()
+            for k in keys:
+                out.append('%d: %s ' % (k, ' '.join(records[k])))
+            out.append('Records found: %d' % len(keys))
+            continue
+        else:
+            continue
+        yield dict(records)
+
+
+def main():
+    records = {}
+    for line in open(sys.argv[1]):
+        fields = line.split()
+        if fields:
+            records[int(fields[0])] = fields[1:6]
+    out = []
+    states = [dict(records)] + list(run(records, sys.argv[2], out))
+    if len(sys.argv) > 3:
+        crash = os.path.join(os.path.dirname(sys.argv[2]), 'crash')
+        if os.path.exists(crash):
+            records = states[int(open(crash).read().split()[1])]
+            out.append('Files recovered from wal.log')
+        list(run(records, sys.argv[3], out))
+    for line in out:
+        print(line)
+
+
+main()
@@ -0,0 +1,98 @@
+#!/bin/sh
+# regression tests - every directory in tests/cases is a case:
+#   data.txt            records the tree is built from
+#   instructions.txt    operations run on it
+#   reopen.txt          (optional) operations run after the files are reopened (OPEN_EXISTING_TREE)
+#   crash               (optional) "bytes operations": the run of instructions.txt is stopped right after its last operation
+#                       (no flush, no checkpoint), that many bytes are cut off the end of wal.log and the files are put back
+#                       as they were before the run, so that only the first that many operations are recovered
+#   *.defines           #define values main.cpp is built with, a line "NAME value" each - every one of them is a run
+#   expected.txt        records read, scanned and errors of the operations, written by model.py (read by hand for threads)
+# usage: tests/run_tests.sh [case...]
+#   TSAN=1 builds with ThreadSanitizer, suppressions from tests/tsan.supp (slow - the threads case takes about half an hour)
+
+cd "$(dirname "$0")/.." || exit 1
+root=$(pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cxxflags="-std=c++17 -O1 -pthread -w"
+if [ -n "$TSAN" ]; then
+    cxxflags="$cxxflags -g -fsanitize=thread"
+    TSAN_OPTIONS="suppressions=$root/tests/tsan.supp halt_on_error=1"
+    export TSAN_OPTIONS
+fi
+
+#keeps only the output that doesn't depend on how the pages are laid out
+filter()
+{
+    awk '/^Loaded record key = / { print; getline; print; next }
+         /^Error: Couldn.t (read|insert|update|remove) record/ || /^[0-9]+:( [0-9]+)+ $/ || /^Records found: / \
+         || /^Records found after the runs: / { print }
+         /^Files recovered from / { sub(/ \(.*/, ""); print }'
+}
+
+#sets #define values of main.cpp to the ones given as "NAME value" lines
+set_defines()
+{
+    awk 'FILENAME == ARGV[1] { name = $1; $1 = ""; value[name] = substr($0, 2); next }
+         $1 == "#define" && ($2 in value) { print "#define     " $2 "     " value[$2]; next }
+         { print }' "$1" main.cpp
+}
+
+failed=0
+cases=${*:-$(ls tests/cases)}
+for name in $cases; do
+    case_dir=$root/tests/cases/$name
+    for defines in "$case_dir"/*.defines; do
+        run=$work/$name-$(basename "$defines" .defines)
+        mkdir -p "$run"
+        {
+            echo 'PRINT_FILES false'
+            echo 'RANDOM_RECORDS false'
+            echo 'MANUAL_TXT_FILENAME "./data.txt"'
+            echo 'RANDOM_TXT_FILENAME "./random_data.txt"'
+            echo 'INSTRUCTIONS_TXT_FILENAME "./instructions.txt"'
+            [ -f "$case_dir/reopen.txt" ] && echo 'OPEN_EXISTING_TREE true'
+            cat "$defines"
+        } > "$run/defines"
+        set_defines "$run/defines" > "$run/main.cpp"
+        if ! g++ $cxxflags -o "$run/main" "$run/main.cpp"; then
+            echo "$name ($(basename "$defines")): build failed"
+            failed=1
+            continue
+        fi
+        [ -f "$case_dir/data.txt" ] && cp "$case_dir/data.txt" "$run/"
+        (
+            cd "$run" || exit 1
+            if [ -f "$case_dir/crash" ]; then
+                #files as they are before the operations, with an empty log
+                : > instructions.txt
+                ./main > /dev/null || exit 1
+                mkdir saved && cp ./*.dat ./*.fsm saved/ 2>/dev/null
+                sed 's/^    process_operations(INSTRUCTIONS_TXT_FILENAME, tree_p);$/&\n    _exit(0);/' main.cpp > crash.cpp
+                g++ $cxxflags -o crash crash.cpp || exit 1
+                cp "$case_dir/instructions.txt" .
+                ./crash || exit 1
+                truncate -s -"$(cut -d' ' -f1 "$case_dir/crash")" wal.log
+                cp saved/* .
+            else
+                [ -f "$case_dir/instructions.txt" ] && cp "$case_dir/instructions.txt" .
+                ./main || exit 1
+            fi
+            if [ -f "$case_dir/reopen.txt" ]; then
+                cp "$case_dir/reopen.txt" instructions.txt
+                ./main || exit 1
+            fi
+        ) > "$run/output.txt" 2> "$run/errors.txt"
+        status=$?
+        filter < "$run/output.txt" > "$run/found.txt"
+        if [ $status -ne 0 ] || ! diff "$case_dir/expected.txt" "$run/found.txt" > "$run/diff.txt"; then
+            echo "$name ($(basename "$defines")): FAILED (exit status $status)"
+            head -20 "$run/diff.txt" "$run/errors.txt"
+            failed=1
+        else
+            echo "$name ($(basename "$defines")): ok"
+        fi
+    done
+done
+exit $failed